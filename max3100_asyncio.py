@@ -0,0 +1,107 @@
+"""asyncio helpers for max3100.MAX3100.
+
+Reads wait on the object's fileno() eventfd, which the background
+receive thread signals whenever characters land in the receive buffer,
+so open the device with rx_thread=True. Without the receive thread,
+reads fall back to running a blocking read() in the default executor.
+Writes always run in the executor; write() releases the GIL while it
+drives the SPI bus.
+
+    dev = max3100_asyncio.AsyncMAX3100(0, 0, baud=57600, rx_thread=True)
+    await dev.write_async(b"...")
+    reply = await dev.read_async(6, timeout=0.5)
+"""
+
+import asyncio
+import os
+
+from max3100 import MAX3100
+
+
+def _reset(fd):
+    try:
+        os.read(fd, 8)
+    except BlockingIOError:
+        pass
+
+
+async def _wait_readable(loop, fd):
+    fut = loop.create_future()
+    loop.add_reader(fd, fut.set_result, None)
+    try:
+        await fut
+    finally:
+        loop.remove_reader(fd)
+
+
+async def _read(dev, length):
+    loop = asyncio.get_running_loop()
+    if not dev.rx_thread:
+        return await loop.run_in_executor(None, dev.read, length)
+    fd = dev.fileno()
+    data = bytearray()
+    while True:
+        # reset before looking so a character stored after the read
+        # below signals the eventfd again
+        _reset(fd)
+        data += dev.read(len(data) - length)
+        if len(data) >= length:
+            return bytes(data)
+        await _wait_readable(loop, fd)
+
+
+async def read_async(dev, length, timeout=None):
+    """Read exactly length bytes, or raise asyncio.TimeoutError."""
+    if length <= 0:
+        return dev.read(length)
+    return await asyncio.wait_for(_read(dev, length), timeout)
+
+
+async def write_async(dev, data):
+    """Write data without blocking the event loop."""
+    loop = asyncio.get_running_loop()
+    await loop.run_in_executor(None, dev.write, data)
+
+
+def open_reader(dev, limit=2**16):
+    """Return an asyncio.StreamReader fed from the receive buffer.
+
+    The device must have its receive thread running. Call
+    close_reader(dev) to stop feeding it.
+    """
+    if not dev.rx_thread:
+        raise ValueError("open the device with rx_thread=True")
+    loop = asyncio.get_running_loop()
+    reader = asyncio.StreamReader(limit=limit, loop=loop)
+    fd = dev.fileno()
+
+    def feed():
+        _reset(fd)
+        data = dev.read()
+        if data:
+            reader.feed_data(data)
+
+    loop.add_reader(fd, feed)
+    feed()
+    return reader
+
+
+def close_reader(dev):
+    """Stop feeding the StreamReader returned by open_reader()."""
+    asyncio.get_running_loop().remove_reader(dev.fileno())
+
+
+class AsyncMAX3100(MAX3100):
+    """MAX3100 with awaitable read_async()/write_async() methods."""
+
+    async def read_async(self, length, timeout=None):
+        return await read_async(self, length, timeout)
+
+    async def write_async(self, data):
+        await write_async(self, data)
+
+    def open_reader(self, limit=2**16):
+        return open_reader(self, limit)
+
+    def close_reader(self):
+        close_reader(self)
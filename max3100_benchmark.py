@@ -0,0 +1,236 @@
+#!/bin/env python3
+"""Throughput/latency benchmark for the max3100 module.
+
+Runs loopback against the host UART (/dev/serial0 by default, wired to
+the MAX3100 as for max3100_serial_loopback.py) over a matrix of baud
+rates, SPI speeds, batch sizes, polling modes and payload sizes, and
+prints one JSON object per configuration:
+
+  rx_bps / tx_bps        sustained bytes/s received / sent by the MAX3100
+  rx_ioctls_per_byte     SPI ioctls per received byte (from stats)
+  tx_ioctls_per_byte     SPI ioctls per transmitted byte
+  cpu                    CPU time / wall time of the MAX3100 process
+  latency_p50/p99        6 byte command to 6 byte echo round trip, seconds
+  errors                 payloads that arrived short or corrupted
+
+The UART side runs in its own process so its CPU use is not counted.
+With --sim no hardware is needed: the driver talks to its simulated
+MAX3100 in loopback, which measures the software overhead alone.
+
+  python3 max3100_benchmark.py --baud 9600 57600 115200 --batch 1 8 \\
+      --payload 64 512 4096 --output results.jsonl
+"""
+
+import argparse
+import itertools
+import json
+import multiprocessing
+import random
+import resource
+import sys
+import time
+
+import max3100
+
+
+def payload(length, seed):
+    return random.Random(seed).randbytes(length)
+
+
+def peer(conn, port):
+    """UART side: executes commands sent over conn until told to stop."""
+    import serial
+    ser = None
+    while True:
+        cmd = conn.recv()
+        op = cmd[0]
+        if op == "stop":
+            break
+        if op == "baud":
+            if ser is not None:
+                ser.close()
+            ser = serial.Serial(port, cmd[1], timeout=cmd[2])
+            ser.reset_input_buffer()
+            ser.reset_output_buffer()
+            conn.send("ok")
+        elif op == "send":
+            conn.send("ok")
+            ser.write(payload(cmd[1], cmd[2]))
+            ser.flush()
+        elif op == "recv":
+            conn.send("ok")
+            data = ser.read(cmd[1])
+            conn.send(data == payload(cmd[1], cmd[2]))
+        elif op == "echo":
+            conn.send("ok")
+            for _ in range(cmd[1]):
+                ser.write(ser.read(6))
+            conn.send("done")
+    if ser is not None:
+        ser.close()
+
+
+class SimPeer:
+    """Stands in for the peer process when the MAX3100 is simulated in
+    loopback: received data is injected, transmitted data comes back."""
+
+    def __init__(self):
+        self.dev = None
+        self.replies = []
+
+    def send(self, cmd):
+        op = cmd[0]
+        if op == "send":
+            self.dev.sim_inject(payload(cmd[1], cmd[2]))
+        elif op == "recv":
+            self.replies.append(self.dev.read(cmd[1], timeout=1.0) == payload(cmd[1], cmd[2]))
+            return
+        elif op == "echo":
+            self.replies.append("ok")
+            self.replies.append("done")
+            return
+        self.replies.append("ok")
+
+    def recv(self):
+        return self.replies.pop(0)
+
+
+def cputime():
+    ru = resource.getrusage(resource.RUSAGE_SELF)
+    return ru.ru_utime + ru.ru_stime
+
+
+def percentile(samples, p):
+    if not samples:
+        return None
+    samples = sorted(samples)
+    return samples[min(len(samples) - 1, int(round(p*(len(samples) - 1))))]
+
+
+def run(conn, args, baud, spispeed, batch, poll, length):
+    timeout = 2 + 20.0*length/baud
+    if args.sim:
+        dev = max3100.MAX3100(crystal=args.crystal, baud=baud, spispeed=spispeed,
+                              maxmisses=args.maxmisses, batch=batch, rx_thread=args.rx_thread,
+                              poll=poll, transport="sim", sim_loopback=True)
+        conn.dev = dev
+    else:
+        conn.send(("baud", baud, timeout))
+        conn.recv()
+        dev = max3100.MAX3100(args.bus, args.device, crystal=args.crystal, baud=baud,
+                              spispeed=spispeed, maxmisses=args.maxmisses, batch=batch,
+                              rx_thread=args.rx_thread, poll=poll)
+    result = {"baud": baud, "spispeed": spispeed, "batch": batch, "poll": poll,
+              "payload": length, "rx_thread": args.rx_thread, "sim": args.sim, "errors": 0}
+    rx_time = tx_time = 0.0
+    rx_bytes = tx_bytes = rx_ioctls = tx_ioctls = 0
+    cpu = wall = 0.0
+    try:
+        for rep in range(args.repeat):
+            # MAX3100 receive
+            dev.clear()
+            dev.reset_stats()
+            conn.send(("send", length, rep))
+            conn.recv()
+            c0, w0 = cputime(), time.perf_counter()
+            first = dev.read(1, timeout=timeout)
+            t0 = time.perf_counter()
+            rest = dev.read(length - 1, timeout=timeout) if length > 1 else b""
+            t1 = time.perf_counter()
+            cpu += cputime() - c0
+            wall += t1 - w0
+            if first + rest != payload(length, rep):
+                result["errors"] += 1
+            if length > 1:
+                rx_time += t1 - t0
+                rx_bytes += length - 1
+            rx_ioctls += dev.stats["ioctls"]
+
+            # MAX3100 transmit
+            dev.reset_stats()
+            if not args.sim:
+                conn.send(("recv", length, rep))
+                conn.recv()
+            data = payload(length, rep)
+            c0, t0 = cputime(), time.perf_counter()
+            dev.write(data)
+            t1 = time.perf_counter()
+            cpu += cputime() - c0
+            wall += t1 - t0
+            tx_time += t1 - t0
+            tx_bytes += length
+            tx_ioctls += dev.stats["ioctls"]
+            if args.sim:
+                conn.send(("recv", length, rep))
+            if not conn.recv():
+                result["errors"] += 1
+
+        # command to response latency
+        samples = []
+        dev.clear()
+        conn.send(("echo", args.commands))
+        conn.recv()
+        for ii in range(args.commands):
+            cmd = bytes((0xAA, ii & 0xff, 0, 0, 0, 0))
+            t0 = time.perf_counter()
+            dev.write(cmd)
+            reply = dev.read(6, timeout=1.0)
+            t1 = time.perf_counter()
+            if reply == cmd:
+                samples.append(t1 - t0)
+            else:
+                result["errors"] += 1
+        conn.recv()
+    finally:
+        dev.close()
+
+    result["rx_bps"] = rx_bytes/rx_time if rx_time else None
+    result["tx_bps"] = tx_bytes/tx_time if tx_time else None
+    result["rx_ioctls_per_byte"] = rx_ioctls/(rx_bytes + args.repeat) if rx_bytes else None
+    result["tx_ioctls_per_byte"] = tx_ioctls/tx_bytes if tx_bytes else None
+    result["cpu"] = cpu/wall if wall else None
+    result["latency_p50"] = percentile(samples, 0.50)
+    result["latency_p99"] = percentile(samples, 0.99)
+    return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+    parser.add_argument("--port", default="/dev/serial0", help="UART wired to the MAX3100")
+    parser.add_argument("--bus", type=int, default=0)
+    parser.add_argument("--device", type=int, default=0)
+    parser.add_argument("--crystal", type=int, default=2)
+    parser.add_argument("--maxmisses", type=int, default=10)
+    parser.add_argument("--rx-thread", action="store_true", help="use the background receive thread")
+    parser.add_argument("--sim", action="store_true", help="use the simulated MAX3100, no hardware needed")
+    parser.add_argument("--baud", type=int, nargs="+", default=[9600, 38400, 115200])
+    parser.add_argument("--spispeed", type=int, nargs="+", default=[7800000])
+    parser.add_argument("--batch", type=int, nargs="+", default=[1, 8])
+    parser.add_argument("--poll", nargs="+", default=["misses"], help="misses, adaptive and/or predictive")
+    parser.add_argument("--payload", type=int, nargs="+", default=[64, 512, 4096])
+    parser.add_argument("--repeat", type=int, default=3, help="transfers per payload size")
+    parser.add_argument("--commands", type=int, default=100, help="latency samples per configuration")
+    parser.add_argument("--output", help="append results here instead of stdout")
+    args = parser.parse_args()
+
+    if args.sim:
+        conn, proc = SimPeer(), None
+    else:
+        conn, child = multiprocessing.Pipe()
+        proc = multiprocessing.Process(target=peer, args=(child, args.port), daemon=True)
+        proc.start()
+    out = open(args.output, "a") if args.output else sys.stdout
+    try:
+        for config in itertools.product(args.baud, args.spispeed, args.batch, args.poll, args.payload):
+            result = run(conn, args, *config)
+            print(json.dumps(result), file=out, flush=True)
+    finally:
+        if proc is not None:
+            conn.send(("stop",))
+            proc.join(5)
+        if out is not sys.stdout:
+            out.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -33,14 +33,31 @@
 #include <stdio.h>
 #include <fcntl.h>
 #include <linux/spi/spidev.h>
+#include <linux/gpio.h>
 #include <linux/types.h>
 #include <sys/ioctl.h>
 #include <linux/ioctl.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <endian.h>
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#include <poll.h>
 
 #define _VERSION_ "0.1"
 #define SPIDEV_MAXPATH 4096
 #define BUFSIZE 8192
+#define MAX_BUFSIZE (1U << 30)
+#define WRITE_CHUNK 512
+#define MAX_PATTERN 64
+#define MAX3100_FIFO 8
+#define MAX3100_MAXBATCH 64
+#define CACHELINE 64
 
 // MAX3100 16-bit constants
 //
@@ -54,7 +71,21 @@
 #define MAX3100_CONF_R              0b1000000000000000
 #define MAX3100_CONF_R_SB           0b0000000010000000
 #define MAX3100_CONF_T              0b0100000000000000
-#define MAX3100_CONF_RM             0b0000110000000000
+#define MAX3100_CONF_TM             0b0000100000000000	/* IRQ while the transmit buffer is empty */
+#define MAX3100_CONF_RM             0b0000010000000000	/* IRQ while received data is waiting */
+#define MAX3100_CONF_FEN            0b0010000000000000	/* set disables the receive FIFO */
+#define MAX3100_CONF_IR             0b0000000010000000	/* IrDA timing */
+#define MAX3100_CONF_ST             0b0000000001000000	/* two stop bits */
+#define MAX3100_CONF_PE             0b0000000000100000	/* ninth (parity) bit sent and received */
+#define MAX3100_CONF_L              0b0000000000010000	/* 7 data bits */
+#define MAX3100_CONF_IRQMASK        0b0000111100000000	/* TM, RM, PM and RAM interrupt masks */
+
+// Write/read data word bits
+#define MAX3100_DATA_TE             0b0000010000000000	/* write: don't transmit this character */
+#define MAX3100_DATA_RTS            0b0000001000000000	/* write: RTS output */
+#define MAX3100_DATA_CTS            0b0000001000000000	/* read: CTS input */
+#define MAX3100_DATA_PT             0b0000000100000000	/* write: parity bit to send */
+#define MAX3100_DATA_PR             0b0000000100000000	/* read: parity bit received */
 
 // Crystal
 #define MAX3100_CRYSTAL_1843kHz     1
@@ -104,6 +135,60 @@
   (byte & 0x0001 ? '1' : '0')
 #define fprintf_binary(file, msg, value) fprintf(file, BYTE_TO_BINARY_PATTERN, msg, BYTE_TO_BINARY(value))
 
+// What to do with a received character when the ring is full.
+#define OVERFLOW_DROP_NEWEST 0
+#define OVERFLOW_DROP_OLDEST 1
+#define OVERFLOW_BLOCK       2	/* leave characters in the MAX3100 FIFO */
+
+// How fetchbytes() decides the FIFO has been drained.
+#define POLL_MISSES   0	/* maxmisses consecutive empty words */
+#define POLL_ADAPTIVE 1	/* no character for a couple of expected gaps */
+#define POLL_PREDICTIVE 2	/* as many words as characters can have arrived */
+
+// Parity, computed in software and carried in the MAX3100's ninth bit
+#define PARITY_NONE 0
+#define PARITY_EVEN 1
+#define PARITY_ODD  2
+
+// Packet checksums
+#define CHECK_NONE  0
+#define CHECK_SUM8  1	/* low byte of the sum of the bytes, as the uCAM's verify */
+#define CHECK_CRC16 2	/* CRC-16/CCITT-FALSE: poly 0x1021, init 0xffff */
+#define CHECK_CRC32 3	/* CRC-32 as zlib.crc32() */
+
+// Simulated MAX3100 limits
+#define SIM_MAXFIFO 256
+
+// SPI word trace ring
+#define TRACE_SIZE 65536
+#define MAX_TRACE_SIZE (1U << 26)
+#define TRACE_FORMAT "=QIHH"	/* struct module layout of MAX3100_TraceRec */
+
+// Per-object lock serializing SPI traffic and ring buffer updates. It is
+// only ever held by code that does not need the GIL, so if it is busy we
+// drop the GIL while waiting for it.
+#define ACQUIRE_MUTEX(mutex) do { \
+	if (pthread_mutex_trylock(mutex) != 0) { \
+		Py_BEGIN_ALLOW_THREADS \
+		pthread_mutex_lock(mutex); \
+		Py_END_ALLOW_THREADS \
+	} } while (0)
+#define ACQUIRE_LOCK(obj) ACQUIRE_MUTEX(&(obj)->lock)
+#define RELEASE_LOCK(obj) pthread_mutex_unlock(&(obj)->lock)
+#define ACQUIRE_RXLOCK(obj) ACQUIRE_MUTEX(&(obj)->rxlock)
+#define RELEASE_RXLOCK(obj) pthread_mutex_unlock(&(obj)->rxlock)
+#define ACQUIRE_TXLOCK(obj) ACQUIRE_MUTEX(&(obj)->txlock)
+#define RELEASE_TXLOCK(obj) pthread_mutex_unlock(&(obj)->txlock)
+#define ACQUIRE_CTLLOCK(obj) ACQUIRE_MUTEX(&(obj)->ctllock)
+#define RELEASE_CTLLOCK(obj) pthread_mutex_unlock(&(obj)->ctllock)
+
+// The receive ring has a single producer at a time (whoever holds the
+// lock) and a single consumer (whoever holds rxlock), so the indices are
+// published with release/acquire ordering and the consumer need not take
+// the lock. Neither relies on the GIL, which consumers release to wait.
+#define LOAD_ACQUIRE(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
+
 #if PY_MAJOR_VERSION < 3
 #define PyLong_AS_LONG(val) PyInt_AS_LONG(val)
 #define PyLong_AsLong(val) PyInt_AsLong(val)
@@ -129,37 +214,239 @@ PyDoc_STRVAR(MAX3100_module_doc,
 	"Because the SPI device interface is opened R/W, users of this\n"
 	"module usually must have root permissions.\n");
 
+/* Driver counters. Only ever updated by whoever holds the object lock,
+   so they are plain integers; readers may see a slightly stale value. */
+typedef struct {
+	uint64_t ioctls;	/* SPI_IOC_MESSAGE calls */
+	uint64_t words;	/* 16-bit words clocked */
+	uint64_t spi_ns;	/* time spent inside SPI ioctls */
+	uint64_t polls;	/* fetchbytes() calls */
+	uint64_t empty_words;	/* READ_DATA words that returned no character */
+	uint64_t rx_chars;	/* characters received from the MAX3100 */
+	uint64_t tx_chars;	/* characters written to the MAX3100 */
+	uint64_t tx_waits;	/* status polls while the transmit buffer was full */
+	uint64_t overflows;	/* characters dropped because the ring was full */
+	uint64_t parity_errors;	/* characters received with the wrong parity bit */
+	/* background thread timed sleeps and how far past the intended
+	   wakeup they returned, a measure of scheduling jitter */
+	uint64_t wakeups;
+	uint64_t wake_late_ns;	/* total */
+	uint64_t wake_late_max_ns;	/* worst */
+	/* updated by read_packet() and bulk_transfer() holding rxlock rather
+	   than the lock */
+	uint64_t packets;	/* valid packets taken from the ring */
+	uint64_t packet_errors;	/* candidate packets discarded as invalid */
+	uint32_t high_water;	/* most characters ever buffered at once */
+} MAX3100_Stats;
+
+/* How a native worker thread is scheduled, see open(rt_priority, cpu). */
+typedef struct {
+	int rt_priority;	/* SCHED_FIFO priority, 0 for the normal policy */
+	int pinned;	/* restricted to cpus */
+	cpu_set_t cpus;
+} MAX3100_Sched;
+
+/* One SPI word as clocked. Every word of a message carries the start
+   time and duration of the whole message. */
+typedef struct {
+	uint64_t t_ns;	/* CLOCK_MONOTONIC when the message started */
+	uint32_t dur_ns;	/* how long the message took */
+	uint16_t tx;	/* word sent */
+	uint16_t rx;	/* word received */
+} MAX3100_TraceRec;
+
+/* Layout of the packets read_packet() hands out, see set_packet_format().
+   Lengths are whole packet sizes; fields are unsigned in byteorder. */
+typedef struct {
+	uint8_t header[MAX_PATTERN];	/* packets start with this */
+	uint32_t headerlen;	/* 0: a packet starts wherever the last one ended */
+	uint32_t length;	/* fixed size, or 0 to use the length field */
+	uint32_t length_offset;	/* where the length field is */
+	uint32_t length_size;	/* 1, 2 or 4 */
+	int32_t overhead;	/* size = length field + overhead */
+	uint32_t max_length;
+	uint32_t min_length;	/* enough to hold the header and every field */
+	uint8_t check;	/* CHECK_* */
+	uint32_t check_size;
+	int32_t check_offset;	/* negative counts from the end; covers all bytes before it */
+	int bigendian;
+} MAX3100_PacketFormat;
+
+/* Reusable SPI message: one spi_ioc_transfer per 16-bit word, each with
+   cs_change set so CS is released between words as the MAX3100 needs.
+   wr clocks tx[], rd the READ_DATA template; both receive into rx[]. The
+   words are kept in the controller's byte order (see spiword()). Built
+   by xfer_setup() once the device is open. */
+typedef struct MAX3100_Xfer {
+	struct spi_ioc_transfer wr[MAX3100_MAXBATCH];
+	struct spi_ioc_transfer rd[MAX3100_MAXBATCH];
+	uint16_t tx[MAX3100_MAXBATCH];
+	uint16_t rx[MAX3100_MAXBATCH];
+	uint16_t readdata[MAX3100_MAXBATCH];
+} MAX3100_Xfer;
+
 typedef struct {
 	PyObject_HEAD
 
 	int fd;	/* open file descriptor: /dev/spidevX.Y */
 	uint8_t mode;	/* current SPI mode */
-	uint8_t bits_per_word;	/* current SPI bits per word setting */
+	uint8_t bits_per_word;	/* 16, or 8 if the controller can't do 16 bit words */
 	uint32_t max_speed_hz;	/* current SPI max speed setting in Hz */
 	uint8_t read0;	/* read 0 bytes after transfer to lwoer CS if SPI_CS_HIGH */
 	uint8_t maxmisses;
-	uint8_t buffer[BUFSIZE];
-	/* good read chars go from bufst ... (bufend-1), 
-	   buffer is empty if bufend == bufst */
+	uint8_t batch;	/* READ_DATA words clocked per ioctl when draining */
+	uint8_t *buffer;	/* receive ring, bufsize bytes */
+	uint32_t bufsize;	/* always a power of two */
+	uint32_t bufmask;	/* bufsize - 1 */
+	/* good read chars go from bufst ... (bufend-1), both free running
+	   and masked on access; buffer is empty if bufend == bufst and full
+	   if bufend - bufst == bufsize */
 	uint32_t bufst;
 	uint32_t bufend;
+	uint8_t overflow;	/* OVERFLOW_* policy when the ring is full */
+	pthread_mutex_t lock;	/* guards fd, SPI transfers and the producer side of the ring */
+	pthread_mutex_t rxlock;	/* held by the consumer of the ring, taken before lock */
+	pthread_mutex_t txlock;	/* held by write(), the producer of txbuf, after rxlock */
+	pthread_mutex_t ctllock;	/* open(), close() and who drains the FIFO, taken first */
+	int ready;	/* MAX3100_new() finished, so there may be something to close */
+	int baud;	/* configured baud rate */
+	int crystal;	/* MAX3100_CRYSTAL_* */
+	long chartime_ns;	/* time on the wire for one 10-bit character */
+	int rx_running;	/* background receive thread is draining the FIFO */
+	int grouped;	/* a MAX3100Group worker is draining the FIFO */
+	pthread_t rx_thread;
+	int irq_fd;	/* gpio line event fd for the MAX3100 IRQ pin, -1 if polling */
+	int64_t timeout_ns;	/* blocking read timeout, -1 waits forever */
+	int64_t inter_byte_timeout_ns;	/* max gap between characters, -1 disabled */
+	int64_t tx_shift_end;	/* estimated time the transmitter goes idle */
+	int efd;	/* eventfd signalled when characters land in the ring, -1 until fileno() */
+	uint8_t pollmode;	/* POLL_* */
+	int64_t last_rx_ns;	/* when a character was last stored */
+	int64_t rx_gap_ns;	/* running average gap between arriving characters */
+	int64_t last_empty_ns;	/* when the FIFO was last seen empty, 0 if unknown */
+	uint16_t conf;	/* configuration last written, without the command bits */
+	uint8_t parity;	/* PARITY_* */
+	int rtscts;	/* drive RTS from the ring fill level and honour CTS */
+	uint16_t rts;	/* MAX3100_DATA_RTS when RTS is asserted, sent with every WRITE_DATA */
+	uint16_t cts;	/* MAX3100_DATA_CTS if CTS was asserted in the last data response */
+	int64_t write_timeout_ns;	/* give up a write after this long, -1 never */
+	/* Transmit queue, used by write() while a background thread services
+	   the device. Filled by write() holding txlock, emptied by whoever
+	   holds the lock; same free running indices as the
+	   receive ring. NULL unless open(txbufsize=...). */
+	uint8_t *txbuf;
+	uint32_t txsize;
+	uint32_t txmask;
+	uint32_t txst;
+	uint32_t txend;
+	MAX3100_Stats stats;
+	MAX3100_Xfer *xf;	/* SPI message descriptors and words, lock held */
+	MAX3100_PacketFormat *packet;	/* NULL until set_packet_format() */
+	int spi_errno;	/* first SPI failure not yet raised, 0 if none */
+	const struct MAX3100_Transport *transport;
+	struct MAX3100_Sim *sim;	/* simulated chip state, NULL unless transport='sim' */
+	struct MAX3100_Capture *capture;	/* capture() in progress, ctllock and rxlock held to change */
+	/* Word trace: written only from spimessage() with the lock held,
+	   read lock free by trace_dump() using tracehead to spot records
+	   overwritten while it copied. trace is kept after trace_stop(). */
+	int tracing;
+	MAX3100_TraceRec *trace;
+	uint32_t tracemask;	/* ring size - 1, a power of two */
+	uint64_t tracehead;	/* records ever written */
 } MAX3100_Object;
 
+/* How SPI messages reach the chip. message() clocks n 16-bit words, each
+   its own spi_ioc_transfer, and returns -1 with errno set on failure;
+   close() releases whatever open() acquired. */
+typedef struct MAX3100_Transport {
+	const char *name;
+	int (*message)(MAX3100_Object *self, struct spi_ioc_transfer *xfer, int n);
+	int (*close)(MAX3100_Object *self);
+} MAX3100_Transport;
+
+static const MAX3100_Transport spidev_transport;
+static const MAX3100_Transport sim_transport;
+
+static void stop_rxthread(MAX3100_Object *self);
+static int capture_finish(MAX3100_Object *self, uint64_t *done);
+
+// The object is connected to a chip, real or simulated.
+#define IS_OPEN(self) ((self)->fd != -1 || (self)->sim != NULL)
+
+// Some other thread keeps this object's FIFO drained into the ring.
+#define BACKGROUND_RX(self) ((self)->rx_running || (self)->grouped)
+
 static PyObject *
 MAX3100_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
 	MAX3100_Object *self;
 	if ((self = (MAX3100_Object *)type->tp_alloc(type, 0)) == NULL)
 		return NULL;
+	// before anything can fail: dealloc always destroys these
+	pthread_mutex_init(&self->lock, NULL);
+	pthread_mutex_init(&self->rxlock, NULL);
+	pthread_mutex_init(&self->txlock, NULL);
+	pthread_mutex_init(&self->ctllock, NULL);
 
 	self->fd = -1;
 	self->mode = 0;
 	self->bits_per_word = 0;
 	self->max_speed_hz = 0;
+	self->maxmisses = 10;
+	self->batch = MAX3100_FIFO;
 	self->bufst=0;
 	self->bufend=0;
-	
-	Py_INCREF(self);
+	self->overflow = OVERFLOW_DROP_NEWEST;
+	memset(&self->stats, 0, sizeof(self->stats));
+	self->bufsize = BUFSIZE;
+	self->bufmask = BUFSIZE - 1;
+	if ((self->buffer = PyMem_RawMalloc(BUFSIZE)) == NULL) {
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+	self->baud = 9600;
+	self->crystal = MAX3100_CRYSTAL_3686kHz;
+	self->chartime_ns = 10*1000000000L/9600;
+	self->rx_running = 0;
+	self->grouped = 0;
+	self->irq_fd = -1;
+	self->timeout_ns = -1;
+	self->inter_byte_timeout_ns = -1;
+	self->tx_shift_end = 0;
+	self->efd = -1;
+	self->pollmode = POLL_MISSES;
+	self->last_rx_ns = 0;
+	self->rx_gap_ns = 0;
+	self->last_empty_ns = 0;
+	self->conf = 0;
+	self->parity = PARITY_NONE;
+	self->rtscts = 0;
+	self->rts = MAX3100_DATA_RTS;
+	self->cts = MAX3100_DATA_CTS;
+	self->write_timeout_ns = -1;
+	self->txbuf = NULL;
+	self->txsize = 0;
+	self->txmask = 0;
+	self->txst = 0;
+	self->txend = 0;
+	self->transport = &spidev_transport;
+	self->sim = NULL;
+	self->tracing = 0;
+	self->trace = NULL;
+	self->tracemask = 0;
+	self->tracehead = 0;
+	self->spi_errno = 0;
+	self->packet = NULL;
+	self->capture = NULL;
+	// descriptors are walked on every word, keep them on their own lines
+	if (posix_memalign((void **)&self->xf, CACHELINE, sizeof(MAX3100_Xfer)) != 0) {
+		self->xf = NULL;
+		Py_DECREF(self);
+		return PyErr_NoMemory();
+	}
+	memset(self->xf, 0, sizeof(MAX3100_Xfer));
+	self->ready = 1;
+
 	return (PyObject *)self;
 }
 
@@ -167,569 +454,4694 @@ PyDoc_STRVAR(MAX3100_close_doc,
 	"close()\n\n"
 	"Disconnects the object from the interface.\n");
 
+static char *busymsg_group = "Device is serviced by a running MAX3100Group.";
+static char *busymsg_capture = "Received data is going to a capture, see capture_stop().";
+
 static PyObject *
-MAX3100_close(MAX3100_Object *self)
+MAX3100_close_locked(MAX3100_Object *self)
 {
-	if ((self->fd != -1) && (close(self->fd) == -1)) {
+	uint64_t captured;
+	if (self->grouped) {
+		PyErr_SetString(PyExc_RuntimeError, busymsg_group);
+		return NULL;
+	}
+	if (self->rx_running) {
+		Py_BEGIN_ALLOW_THREADS
+		stop_rxthread(self);
+		Py_END_ALLOW_THREADS
+	}
+	capture_finish(self, &captured);
+	ACQUIRE_LOCK(self);
+	if (self->transport->close(self) == -1) {
+		RELEASE_LOCK(self);
 		PyErr_SetFromErrno(PyExc_IOError);
 		return NULL;
 	}
 
-	self->fd = -1;
+	self->transport = &spidev_transport;
+	STORE_RELEASE(&self->txst, LOAD_ACQUIRE(&self->txend));
 	self->mode = 0;
 	self->bits_per_word = 0;
 	self->max_speed_hz = 0;
+	if (self->irq_fd != -1) {
+		close(self->irq_fd);
+		self->irq_fd = -1;
+	}
+	if (self->efd != -1) {
+		close(self->efd);
+		self->efd = -1;
+	}
+	RELEASE_LOCK(self);
 
 	Py_INCREF(Py_None);
 	return Py_None;
 }
 
+static PyObject *
+MAX3100_close(MAX3100_Object *self)
+{
+	PyObject *result;
+	ACQUIRE_CTLLOCK(self);
+	result = MAX3100_close_locked(self);
+	RELEASE_CTLLOCK(self);
+	return result;
+}
+
 static void
 MAX3100_dealloc(MAX3100_Object *self)
 {
-	PyObject *ref = MAX3100_close(self);
-	Py_XDECREF(ref);
+	PyTypeObject *tp = Py_TYPE(self);
+	if (self->ready) {
+		PyObject *ref = MAX3100_close(self);
+		Py_XDECREF(ref);
+	}
+	pthread_mutex_destroy(&self->lock);
+	pthread_mutex_destroy(&self->rxlock);
+	pthread_mutex_destroy(&self->txlock);
+	pthread_mutex_destroy(&self->ctllock);
+	PyMem_RawFree(self->buffer);
+	PyMem_RawFree(self->txbuf);
+	PyMem_RawFree(self->trace);
+	free(self->xf);
+	PyMem_RawFree(self->packet);
 
-	Py_TYPE(self)->tp_free((PyObject *)self);
+	tp->tp_free((PyObject *)self);
+	Py_DECREF(tp);
 }
 
-uint16_t swapbytes(uint16_t data) {
-	return ((data << 8) & 0xff00) | ((data >> 8) & 0x00ff);
+static void sleep_ns(long ns) {
+	struct timespec ts;
+	ts.tv_sec = ns / 1000000000L;
+	ts.tv_nsec = ns % 1000000000L;
+	nanosleep(&ts, NULL);
 }
 
-uint16_t transfer16(MAX3100_Object *self, uint16_t send) {
-	uint16_t recv=0;
-	// fprintf_binary(stderr, "send", send);
-	send = swapbytes(send);
-	struct spi_ioc_transfer xfer;
-	memset(&xfer, 0, sizeof(xfer));
-  xfer.tx_buf = (unsigned long)&send;
-	xfer.rx_buf = (unsigned long)&recv;
-	xfer.len = 2;
-	xfer.delay_usecs = 0;
-	xfer.speed_hz = self->max_speed_hz;
-	xfer.bits_per_word = self->bits_per_word;
-	ioctl(self->fd, SPI_IOC_MESSAGE(1), &xfer);
-	recv = swapbytes(recv);
-	// fprintf_binary(stderr, "recv", recv);
-	return recv;
+static int64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec*1000000000L + ts.tv_nsec;
 }
 
-void fetchbytes(MAX3100_Object *self) {
-	uint16_t r;
-	uint8_t misses = 0;
-	while (misses < self->maxmisses) {
-		r = transfer16(self, MAX3100_CMD_READ_DATA);
-		if (r&MAX3100_CONF_R) {
-		  self->buffer[self->bufend] = (uint8_t)(r&0xff);
-			// fprintf(stderr, "store - %04d: %02X\n", bufend, buffer[bufend]);
-		  self->bufend += 1;
-		  if (self->bufend >= BUFSIZE) {
-		    self->bufend = 0;
-		  }
-			assert(self->bufend != self->bufst);
-			misses = 0;
-		} else {
-			misses += 1;
-		}
-	}
+// Sleep ns and return how late the wakeup was.
+static int64_t timed_sleep(long ns) {
+	int64_t late, wake = now_ns() + ns;
+	sleep_ns(ns);
+	late = now_ns() - wake;
+	return late > 0 ? late : 0;
 }
 
-void fetchbytes_new(MAX3100_Object *self) {
-	uint8_t n = 8;
-	uint16_t s[n];
-	uint16_t r[n];
-	uint8_t misses = 0;
-	struct spi_ioc_transfer xfer;
-	memset(&xfer, 0, sizeof(xfer));
-	xfer.tx_buf = (unsigned long)s;
-	xfer.rx_buf = (unsigned long)r;
-	xfer.len = n*2;
-	xfer.speed_hz = self->max_speed_hz;
-	xfer.bits_per_word = self->bits_per_word;
-	memset(s,0,n*sizeof(uint16_t));
-	while (misses < self->maxmisses) {
-		ioctl(self->fd, SPI_IOC_MESSAGE(1), &xfer);
-		for (int i=0; i<n; i++) {
-		  if (r[i]&MAX3100_CONF_R_SB) {
-		    self->buffer[self->bufend] = (uint8_t)(r[i]>>8);
-			  // fprintf(stderr, "store - %04d: %02X\n", self->bufend, self->buffer[self->bufend]);
-		    self->bufend = (self->bufend + 1)%BUFSIZE;
-			  assert(self->bufend != self->bufst);
-			  misses = 0;
-		  } else {
-			  misses += 1;
-		  }
-	  }
+static void note_wakeup(MAX3100_Stats *st, int64_t late) {
+	st->wakeups++;
+	st->wake_late_ns += late;
+	if ((uint64_t)late > st->wake_late_max_ns) {
+		st->wake_late_max_ns = late;
 	}
 }
 
-void putbyte(MAX3100_Object *self, uint8_t uch) {
-	uint16_t r;
-	while (1) {
-		r = transfer16(self, MAX3100_CMD_READ_CONF);
-		if (r&MAX3100_CONF_R) {
-			fetchbytes(self);
-		} else if (r&MAX3100_CONF_T) {
-			break;
-		}
+// Check rt_priority and turn cpu (None, a CPU number or a sequence of
+// them) into a CPU set.
+static int parse_sched(int rt_priority, PyObject *cpu, MAX3100_Sched *sched) {
+	PyObject *seq;
+	Py_ssize_t ii;
+	long n;
+	int maxprio = sched_get_priority_max(SCHED_FIFO);
+	if (rt_priority < 0 || rt_priority > maxprio) {
+		PyErr_Format(PyExc_ValueError, "rt_priority must be between 0 and %d.", maxprio);
+		return -1;
 	}
-	r = transfer16(self,MAX3100_CMD_WRITE_DATA|uch);
-	if (r&MAX3100_CONF_R) {
-	  self->buffer[self->bufend] = (uint8_t)(r&0xff);
-	  // fprintf(stderr, "store - %04d: %02X\n", bufend, buffer[bufend]);
-		self->bufend += 1;
-		if (self->bufend >= BUFSIZE) {
-		  self->bufend = 0;
+	sched->rt_priority = rt_priority;
+	sched->pinned = 0;
+	CPU_ZERO(&sched->cpus);
+	if (cpu == NULL || cpu == Py_None)
+		return 0;
+	if (PyLong_Check(cpu)) {
+		seq = PyTuple_Pack(1, cpu);
+	} else {
+		seq = PySequence_Fast(cpu, "cpu must be a CPU number or a sequence of them.");
+	}
+	if (seq == NULL)
+		return -1;
+	if (PySequence_Fast_GET_SIZE(seq) == 0) {
+		Py_DECREF(seq);
+		PyErr_SetString(PyExc_ValueError, "cpu must name at least one CPU.");
+		return -1;
+	}
+	for (ii = 0; ii < PySequence_Fast_GET_SIZE(seq); ii++) {
+		n = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, ii));
+		if (n == -1 && PyErr_Occurred()) {
+			Py_DECREF(seq);
+			return -1;
 		}
-		assert(self->bufend != self->bufst);
-		fetchbytes(self);
+		if (n < 0 || n >= CPU_SETSIZE) {
+			Py_DECREF(seq);
+			PyErr_Format(PyExc_ValueError, "CPU numbers must be between 0 and %d.", CPU_SETSIZE - 1);
+			return -1;
+		}
+		CPU_SET(n, &sched->cpus);
 	}
+	Py_DECREF(seq);
+	sched->pinned = 1;
+	return 0;
 }
 
-uint8_t getbyte(MAX3100_Object *self, uint8_t *uch) {
-	fetchbytes(self);
-	if (self->bufend != self->bufst) {
-		*uch = self->buffer[self->bufst];
-		// fprintf(stderr, "get   - %04d: %02X\n", bufst, buffer[bufst]);
-		self->bufst += 1;
-		if (self->bufst >= BUFSIZE) {
-			self->bufst = 0;
+// pthread_create() with the policy, priority and affinity in sched;
+// returns 0 or an errno value. Real-time priorities need CAP_SYS_NICE
+// or an RLIMIT_RTPRIO allowance, otherwise this fails with EPERM.
+static int start_thread(pthread_t *thread, void *(*fn)(void *), void *arg, const MAX3100_Sched *sched) {
+	pthread_attr_t attr;
+	struct sched_param param;
+	int err;
+	if ((err = pthread_attr_init(&attr)) != 0)
+		return err;
+	if (sched->rt_priority > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = sched->rt_priority;
+		if ((err = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED)) != 0 ||
+		    (err = pthread_attr_setschedpolicy(&attr, SCHED_FIFO)) != 0 ||
+		    (err = pthread_attr_setschedparam(&attr, &param)) != 0) {
+			pthread_attr_destroy(&attr);
+			return err;
 		}
-		return 1;
-	} 
+	}
+	if (sched->pinned &&
+	    (err = pthread_attr_setaffinity_np(&attr, sizeof(sched->cpus), &sched->cpus)) != 0) {
+		pthread_attr_destroy(&attr);
+		return err;
+	}
+	err = pthread_create(thread, &attr, fn, arg);
+	pthread_attr_destroy(&attr);
+	return err;
+}
+
+// Keep the whole process resident so a page fault never stalls a worker.
+static int lock_memory(void) {
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		return -1;
+	}
 	return 0;
 }
 
-int available(MAX3100_Object *self) {
-  fetchbytes(self);
-	if (self->bufend < self->bufst) {
-		return (self->bufend+BUFSIZE-self->bufst);
-  }
-	return (self->bufend-self->bufst);
+// Time on the wire for one character with the framing in conf.
+static long framebits(uint16_t conf) {
+	return 1 + ((conf & MAX3100_CONF_L) ? 7 : 8) + ((conf & MAX3100_CONF_PE) ? 1 : 0)
+	         + ((conf & MAX3100_CONF_ST) ? 2 : 1);
 }
 
-void clear(MAX3100_Object *self) {
-	fetchbytes(self);
-	self->bufst = self->bufend = 0;
+static inline uint8_t datamask(MAX3100_Object *self) {
+	return (self->conf & MAX3100_CONF_L) ? 0x7f : 0xff;
 }
 
-static char *wrmsg_list0 = "Empty argument list.";
-static char *wrmsg_listmax = "Argument list size exceeds %d bytes.";
-static char *wrmsg_val = "Non-Int/Long value in arguments: %x.";
+// The ninth bit to send with (or expect with) character c.
+static inline uint16_t paritybit(MAX3100_Object *self, uint8_t c) {
+	int odd = __builtin_parity(c & datamask(self));
+	switch (self->parity) {
+		case PARITY_EVEN: return odd ? MAX3100_DATA_PT : 0;
+		case PARITY_ODD: return odd ? 0 : MAX3100_DATA_PT;
+		default: return 0;
+	}
+}
 
-PyDoc_STRVAR(MAX3100_write_doc,
-	"write([values]) -> None\n\n"
-	"Write bytes via the MAX3100.\n");
+static int spidev_message(MAX3100_Object *self, struct spi_ioc_transfer *xfer, int n) {
+	return ioctl(self->fd, SPI_IOC_MESSAGE(n), xfer);
+}
 
-static PyObject *
-MAX3100_writebytes(MAX3100_Object *self, PyObject *args)
-{
-	uint16_t	ii, len;
-	uint8_t	buf[SPIDEV_MAXPATH];
-	PyObject	*obj;
-	PyObject	*seq;
-	char	wrmsg_text[4096];
+static int spidev_close(MAX3100_Object *self) {
+	if (self->fd != -1 && close(self->fd) == -1) {
+		return -1;
+	}
+	self->fd = -1;
+	return 0;
+}
 
-	if (!PyArg_ParseTuple(args, "O:write", &obj))
-		return NULL;
+static const MAX3100_Transport spidev_transport = {"spidev", spidev_message, spidev_close};
 
-	seq = PySequence_Fast(obj, "expected a sequence");
-	len = PySequence_Fast_GET_SIZE(seq);
-	if (!seq || len <= 0) {
-		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
-		return NULL;
+/* Simulated MAX3100, so the driver can be exercised and benchmarked
+   without hardware. It models the configuration register, the receive
+   FIFO (with overruns), the transmit holding and shift registers paced
+   in real time at the configured baud rate, and a receive line fed by
+   sim_inject() and, with loopback, by the characters it transmits.
+   The SPI bus itself takes no time, so spi_ns in stats measures the
+   driver's own overhead. Only touched with the object lock held. */
+typedef struct {
+	int64_t t;	/* when the character has been completely received */
+	uint16_t c;	/* character, parity bit in bit 8 */
+} MAX3100_SimChar;
+
+typedef struct MAX3100_Sim {
+	uint16_t conf;	/* last WRITE_CONF, command bits stripped */
+	uint16_t depth;	/* receive FIFO depth with the FIFO enabled */
+	uint16_t fifo[SIM_MAXFIFO];
+	uint16_t fifost;
+	uint16_t fifocount;
+	MAX3100_SimChar *line;	/* characters on their way in, oldest at linest */
+	size_t linest;
+	size_t lineend;
+	size_t linesize;
+	int64_t interval_ns;	/* spacing of injected characters, 0 for back to back */
+	int loopback;	/* transmitted characters are received again */
+	int64_t hold_free;	/* transmit holding register empties */
+	int64_t shift_end;	/* transmit shift register empties */
+	uint16_t rts;	/* the far end stops sending while we deassert RTS */
+	int64_t rts_off;	/* when RTS was deasserted */
+	uint16_t cts;	/* CTS input, MAX3100_DATA_CTS when asserted */
+	uint64_t overruns;	/* characters lost to a full FIFO */
+} MAX3100_Sim;
+
+static MAX3100_Sim *sim_alloc(void) {
+	MAX3100_Sim *sim = PyMem_RawCalloc(1, sizeof(MAX3100_Sim));
+	if (sim) {
+		sim->depth = MAX3100_FIFO;
+		sim->rts = MAX3100_DATA_RTS;
+		sim->cts = MAX3100_DATA_CTS;
 	}
+	return sim;
+}
 
-	if (len > SPIDEV_MAXPATH) {
-		snprintf(wrmsg_text, sizeof (wrmsg_text) - 1, wrmsg_listmax, SPIDEV_MAXPATH);
-		PyErr_SetString(PyExc_OverflowError, wrmsg_text);
-		return NULL;
+static void sim_free(MAX3100_Sim *sim) {
+	if (sim) {
+		PyMem_RawFree(sim->line);
+		PyMem_RawFree(sim);
 	}
+}
 
-  // fprintf(stderr, "length: %d\n", len);
-	for (ii = 0; ii < len; ii++) {
-		PyObject *val = PySequence_Fast_GET_ITEM(seq, ii);
-		// PyObject_Print((PyObject *)Py_TYPE(val), stderr, 0);
-		// fprintf(stderr, "\n");
-		// fprintf(stderr, "%d\n",PyLong_Check(val));
-#if PY_MAJOR_VERSION < 3
-		if (PyInt_Check(val)) {
-			buf[ii] = (__u8)PyInt_AS_LONG(val);
-		} else
-#endif
-		{
-			if (PyLong_Check(val)) {
-				buf[ii] = (__u8)PyLong_AS_LONG(val);
-			} else {
-				snprintf(wrmsg_text, sizeof (wrmsg_text) - 1, wrmsg_val, val);
-				PyErr_SetString(PyExc_TypeError, wrmsg_text);
-				return NULL;
+// Put a character on the receive line, arriving no earlier than t.
+static int sim_linechar(MAX3100_Sim *sim, int64_t t, uint16_t c) {
+	MAX3100_SimChar *line;
+	size_t size;
+	if (sim->lineend == sim->linesize) {
+		if (sim->linest > 0) {
+			memmove(sim->line, sim->line + sim->linest,
+			        (sim->lineend - sim->linest)*sizeof(MAX3100_SimChar));
+			sim->lineend -= sim->linest;
+			sim->linest = 0;
+		} else {
+			size = sim->linesize ? 2*sim->linesize : 256;
+			if ((line = PyMem_RawRealloc(sim->line, size*sizeof(MAX3100_SimChar))) == NULL) {
+				return -1;
 			}
+			sim->line = line;
+			sim->linesize = size;
 		}
 	}
-
-	Py_DECREF(seq);
-
-  for (int ii=0; ii<len; ii++) {
-		putbyte(self, buf[ii]);
+	if (sim->lineend > sim->linest && sim->line[sim->lineend-1].t > t) {
+		t = sim->line[sim->lineend-1].t;
 	}
-	
-	Py_INCREF(Py_None);
-	return Py_None;
+	sim->line[sim->lineend].t = t;
+	sim->line[sim->lineend].c = c;
+	sim->lineend++;
+	return 0;
 }
 
-PyDoc_STRVAR(MAX3100_read_doc,
-	"read(length=0) -> [values]\n\n"
-	"Read length bytes from SPI device.\n  length > 0, blocking read for length characters\n  length == 0, non-blocking read as many as possible (depends on maxmisses)\n  length < 0, non-blocking read for at most length characters (depends on maxmisses)\n");
-
-static PyObject *
-MAX3100_readbytes(MAX3100_Object *self, PyObject *args, PyObject *kwds)
-{
-	uint8_t	rxbuf[SPIDEV_MAXPATH];
-	int	ii;
-	int len=0;
-	
-	// PyObject	*list;
-  static char *kwlist[] = {"length", NULL};
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|i:read", kwlist, &len))
-		return NULL;
-	
-	int blocking=1;
-	if (len <= 0) {
-		blocking = 0;
-		len = -len;
+// Move every character whose stop bit has passed into the FIFO.
+static void sim_advance(MAX3100_Sim *sim, int64_t now) {
+	uint16_t depth = (sim->conf & MAX3100_CONF_FEN) ? 1 : sim->depth;
+	while (sim->linest < sim->lineend && sim->line[sim->linest].t <= now) {
+		if (sim->fifocount < depth) {
+			sim->fifo[(sim->fifost + sim->fifocount) % SIM_MAXFIFO] = sim->line[sim->linest].c;
+			sim->fifocount++;
+		} else {
+			sim->overruns++;
+		}
+		sim->linest++;
+	}
+	if (sim->linest == sim->lineend) {
+		sim->linest = sim->lineend = 0;
 	}
+}
 
-	memset(rxbuf, 0, sizeof rxbuf);
-	ii = 0;
-	if (blocking) {
-	  while (ii < len) {
-		  if (getbyte(self, &(rxbuf[ii]))) {
-	      ii++;
-		  }
-		}
-	} else {
-		while (getbyte(self, &(rxbuf[ii]))) {
-			ii++;
-      if (len > 0 && ii == len) {
-        break;
-			}				
+// Response bits common to every command: R, T and, for data, the character.
+static uint16_t sim_status(MAX3100_Sim *sim, int64_t now, int pop) {
+	uint16_t r = 0;
+	if (sim->hold_free <= now) {
+		r |= MAX3100_CONF_T;
+	}
+	if (sim->fifocount) {
+		r |= MAX3100_CONF_R;
+		if (pop) {
+			r |= sim->fifo[sim->fifost];	// includes Pr
+			sim->fifost = (sim->fifost + 1) % SIM_MAXFIFO;
+			sim->fifocount--;
 		}
-		len = ii;
 	}
-	
-	PyObject *val = Py_BuildValue("y#",rxbuf,len);
-	return val;
+	return r;
 }
 
-PyDoc_STRVAR(MAX3100_available_doc,
-	"available() -> number of characters currently available to read\n");
-
-static PyObject *
-MAX3100_available(MAX3100_Object *self)
-{
-	PyObject *result = Py_BuildValue("i", available(self));
-	Py_INCREF(result);
-	return result;
+/* RTS reasserted: the far end carries on where it stopped, after
+   finishing the character it was sending when RTS went away. */
+static void sim_resume(MAX3100_Sim *sim, int64_t now, int64_t chartime) {
+	int64_t paused = now - sim->rts_off;
+	for (size_t i = sim->linest; i < sim->lineend; i++) {
+		if (sim->line[i].t > sim->rts_off + chartime) {
+			sim->line[i].t += paused;
+		}
+	}
 }
 
-static PyObject *
-MAX3100_inwaiting(MAX3100_Object *self, void *closure)
-{
-	PyObject *result = Py_BuildValue("i", available(self));
-	Py_INCREF(result);
-	return result;
+static uint16_t sim_word(MAX3100_Object *self, uint16_t w, int64_t now) {
+	MAX3100_Sim *sim = self->sim;
+	uint16_t r, c;
+	int64_t start, until = now;
+	if (!sim->rts && until > sim->rts_off + self->chartime_ns) {
+		until = sim->rts_off + self->chartime_ns;
+	}
+	sim_advance(sim, until);
+	switch (w & 0xc000) {
+		case MAX3100_CMD_WRITE_CONF:
+			r = sim_status(sim, now, 0);
+			sim->conf = w & 0x3fff;
+			break;
+		case MAX3100_CMD_READ_CONF:
+			r = sim_status(sim, now, 0) | (sim->conf & 0x3fff);
+			break;
+		case MAX3100_CMD_WRITE_DATA:
+			r = sim_status(sim, now, 1) | sim->cts;
+			if (sim->rts && !(w & MAX3100_DATA_RTS)) {
+				sim->rts_off = now;
+			} else if (!sim->rts && (w & MAX3100_DATA_RTS)) {
+				sim_resume(sim, now, self->chartime_ns);
+			}
+			sim->rts = w & MAX3100_DATA_RTS;
+			if ((w & MAX3100_DATA_TE) || !(r & MAX3100_CONF_T)) {
+				break;
+			}
+			// straight into the shift register if it is idle, else into
+			// the holding register until the one ahead has gone out
+			start = (sim->shift_end > now) ? sim->shift_end : now;
+			sim->hold_free = start;
+			sim->shift_end = start + self->chartime_ns;
+			if (sim->loopback) {
+				c = w & datamask(self);
+				if (sim->conf & MAX3100_CONF_PE) {
+					c |= w & MAX3100_DATA_PT;
+				}
+				sim_linechar(sim, sim->shift_end, c);
+			}
+			break;
+		default:
+			r = sim_status(sim, now, 1) | sim->cts;
+			break;
+	}
+	return r;
 }
 
-PyDoc_STRVAR(MAX3100_clear_doc,
-	"clear() -> flush all yet to be read characters\n");
+static int sim_message(MAX3100_Object *self, struct spi_ioc_transfer *xfer, int n) {
+	int64_t now = now_ns();
+	uint8_t *tx, *rx;
+	uint16_t w, r;
+	for (int i=0; i<n; i++) {
+		if (xfer[i].len != 2) {
+			errno = EINVAL;
+			return -1;
+		}
+		tx = (uint8_t *)(uintptr_t)xfer[i].tx_buf;
+		rx = (uint8_t *)(uintptr_t)xfer[i].rx_buf;
+		if (xfer[i].bits_per_word == 16) {
+			// one native word
+			w = tx ? *(uint16_t *)tx : 0;
+			r = sim_word(self, w, now);
+			if (rx) {
+				*(uint16_t *)rx = r;
+			}
+			continue;
+		}
+		// bytes go out most significant first
+		w = tx ? (uint16_t)(tx[0] << 8 | tx[1]) : 0;
+		r = sim_word(self, w, now);
+		if (rx) {
+			rx[0] = r >> 8;
+			rx[1] = r & 0xff;
+		}
+	}
+	return 0;
+}
 
-static PyObject *
-MAX3100_clear(MAX3100_Object *self)
-{
-	clear(self);
-	Py_INCREF(Py_None);
-	return Py_None;
+static int sim_close(MAX3100_Object *self) {
+	sim_free(self->sim);
+	self->sim = NULL;
+	return 0;
 }
 
+static const MAX3100_Transport sim_transport = {"sim", sim_message, sim_close};
 
-PyDoc_STRVAR(MAX3100_open_doc,
-	"open(bus=0, device=0, crystal=2, baud=9600, spispeed=7800000, maxmisses=10)\n\n"
-	"Connects the object to the specified SPI device.\n"
-	"open(X,Y,...) will open /dev/spidev<X>.<Y>\n");
+// Attach a fresh simulated chip, 0 or -1 with errno set.
+static int sim_open(MAX3100_Object *self, int depth, int rate, int loopback) {
+	if ((self->sim = sim_alloc()) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	self->sim->depth = depth;
+	self->sim->interval_ns = rate ? 1000000000L/rate : 0;
+	self->sim->loopback = loopback;
+	self->transport = &sim_transport;
+	self->mode = 0;
+	self->bits_per_word = 16;
+	return 0;
+}
 
-static PyObject *
-MAX3100_open(MAX3100_Object *self, PyObject *args, PyObject *kwds)
-{
-	int bus=0;
-	int device=0;
-	int crystal=2;
-	int baud=9600;
-	int spispeed = 7800000;
-	int maxmisses = 10;
-	char path[SPIDEV_MAXPATH];
+// Open /dev/spidevX.Y and read back its settings, 0 or -1 with errno set.
+static int spidev_open(MAX3100_Object *self, const char *path, uint32_t speed) {
 	uint8_t tmp8;
-	//uint32_t tmp32;
-	static char *kwlist[] = {"bus", "device", "crystal", "baud", "spispeed", "maxmisses", NULL};
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiiiii:open", kwlist, 
-	                                 &bus, &device, &crystal, &baud, &spispeed, &maxmisses))
-		return NULL;
-	if (snprintf(path, SPIDEV_MAXPATH, "/dev/spidev%d.%d", bus, device) >= SPIDEV_MAXPATH) {
-		PyErr_SetString(PyExc_OverflowError,
-			"Bus and/or device number is invalid.");
-		return NULL;
-	}
-  
+	int err;
 	if ((self->fd = open(path, O_RDWR, 0)) == -1) {
-		PyErr_SetFromErrno(PyExc_IOError);
-		return NULL;
+		return -1;
 	}
-	
 	if (ioctl(self->fd, SPI_IOC_RD_MODE, &tmp8) == -1) {
-		PyErr_SetFromErrno(PyExc_IOError);
-		return NULL;
+		goto fail;
 	}
 	self->mode = tmp8;
-	
-	if (ioctl(self->fd, SPI_IOC_RD_BITS_PER_WORD, &tmp8) == -1) {
-		PyErr_SetFromErrno(PyExc_IOError);
-		return NULL;
+	// With 16 bit words the controller sends each word most significant
+	// bit first straight from host order; not every controller can, and
+	// 8 bit words then need the bytes in big endian order.
+	tmp8 = 16;
+	if (ioctl(self->fd, SPI_IOC_WR_BITS_PER_WORD, &tmp8) == -1) {
+		tmp8 = 8;
+		if (ioctl(self->fd, SPI_IOC_WR_BITS_PER_WORD, &tmp8) == -1) {
+			goto fail;
+		}
 	}
 	self->bits_per_word = tmp8;
-	
-	uint32_t spispeed_ = spispeed;
-	if (ioctl(self->fd, SPI_IOC_WR_MAX_SPEED_HZ, &spispeed_) == -1) {
-		PyErr_SetFromErrno(PyExc_IOError);
-		return NULL;
+	if (ioctl(self->fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) == -1) {
+		goto fail;
 	}
-	self->max_speed_hz = spispeed_;
-	self->maxmisses = maxmisses;
-
-  uint16_t conf;
-  if (crystal == 2)
-  {
-    switch (baud)
-    {
-      case 230400 : conf = MAX3100_CONF_BAUD_X2_230400; break;
-      case 115200 : conf = MAX3100_CONF_BAUD_X2_115200; break;
-      case 57600  : conf = MAX3100_CONF_BAUD_X2_57600; break;
-      case 38400  : conf = MAX3100_CONF_BAUD_X2_38400; break;
-      case 19200  : conf = MAX3100_CONF_BAUD_X2_19200; break;
-      case 4800   : conf = MAX3100_CONF_BAUD_X2_4800; break;
-      case 2400   : conf = MAX3100_CONF_BAUD_X2_2400; break;
-      case 1200   : conf = MAX3100_CONF_BAUD_X2_1200; break;
-      case 600    : conf = MAX3100_CONF_BAUD_X2_600; break;
-      default     : conf = MAX3100_CONF_BAUD_X2_9600; break;
-    }
-  }
-  else
-  {
-    switch (baud)
-    {
-      case 115200 : conf = MAX3100_CONF_BAUD_X1_115200; break;
-      case 57600  : conf = MAX3100_CONF_BAUD_X1_57600; break;
-      case 38400  : conf = MAX3100_CONF_BAUD_X1_38400; break;
-      case 19200  : conf = MAX3100_CONF_BAUD_X1_19200; break;
-      case 4800   : conf = MAX3100_CONF_BAUD_X1_4800; break;
-      case 2400   : conf = MAX3100_CONF_BAUD_X1_2400; break;
-      case 1200   : conf = MAX3100_CONF_BAUD_X1_1200; break;
-      case 600    : conf = MAX3100_CONF_BAUD_X1_600; break;
-      case 300    : conf = MAX3100_CONF_BAUD_X1_300; break;
-      default     : conf = MAX3100_CONF_BAUD_X1_9600; break;
-    }
-  }	
+	self->transport = &spidev_transport;
+	return 0;
 
-  // Do we want the MAX3100_CONF_RM? What does this mean for us?
-  conf |= (MAX3100_CMD_WRITE_CONF | MAX3100_CONF_RM);
-  transfer16(self, conf);
-	
-	Py_INCREF(Py_None);
-	return Py_None;
+fail:
+	// report the ioctl that failed, not the close
+	err = errno;
+	close(self->fd);
+	self->fd = -1;
+	errno = err;
+	return -1;
 }
 
-static int
-MAX3100_init(MAX3100_Object *self, PyObject *args, PyObject *kwds)
-{
-	int bus = -1;
-	int client = -1;
-	int crystal = -1;
-	int baud = -1;
-	int spispeed = -1;
-	int maxmisses = -1;
-	static char *kwlist[] = {"bus", "client", "crystal", "baud", "spispeed", "maxmisses", NULL};
+// A word in the byte order of the words clocked by an spi_ioc_transfer.
+static inline uint16_t spiword(uint8_t bits_per_word, uint16_t w) {
+	return (bits_per_word == 16) ? w : htobe16(w);
+}
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiiiii:__init__",
-			kwlist, &bus, &client, &crystal, &baud, &spispeed, &maxmisses))
-		return -1;
+// The word an spi_ioc_transfer buffer holds.
+static inline uint16_t xferword(const struct spi_ioc_transfer *xfer, uint64_t buf) {
+	const uint16_t *p = (const uint16_t *)(uintptr_t)buf;
+	return p ? spiword(xfer->bits_per_word, *p) : 0;
+}
 
-	if (bus >= 0) {
-		MAX3100_open(self, args, kwds);
-		if (PyErr_Occurred())
-			return -1;
+static void trace_record(MAX3100_Object *self, const struct spi_ioc_transfer *xfer, int n,
+                         int64_t start, int64_t dur) {
+	uint64_t head = self->tracehead;
+	MAX3100_TraceRec *rec;
+	for (int i=0; i<n; i++) {
+		rec = &self->trace[(head + i) & self->tracemask];
+		rec->t_ns = start;
+		rec->dur_ns = (uint32_t)dur;
+		rec->tx = xferword(&xfer[i], xfer[i].tx_buf);
+		rec->rx = xferword(&xfer[i], xfer[i].rx_buf);
 	}
+	STORE_RELEASE(&self->tracehead, head + n);
+}
 
+// Every SPI message goes through here so it is counted, timed and traced.
+// A failure is kept in spi_errno for spi_check() to raise, and the
+// response words are zeroed so that nothing reads as a character.
+static inline int spimessage(MAX3100_Object *self, struct spi_ioc_transfer *xfer, int n) {
+	int64_t start = now_ns();
+	int rc = self->transport->message(self, xfer, n);
+	int64_t dur = now_ns() - start;
+	self->stats.spi_ns += dur;
+	self->stats.ioctls++;
+	self->stats.words += n;
+	if (rc < 0) {
+		if (LOAD_ACQUIRE(&self->spi_errno) == 0) {
+			STORE_RELEASE(&self->spi_errno, errno ? errno : EIO);
+		}
+		for (int i=0; i<n; i++) {
+			if (xfer[i].rx_buf) {
+				*(uint16_t *)(uintptr_t)xfer[i].rx_buf = 0;
+			}
+		}
+		return -1;
+	}
+	if (self->tracing) {
+		trace_record(self, xfer, n, start, dur);
+	}
 	return 0;
 }
 
+static void xfer_setup(MAX3100_Object *self) {
+	MAX3100_Xfer *xf = self->xf;
+	memset(xf, 0, sizeof(*xf));
+	for (int i=0; i<MAX3100_MAXBATCH; i++) {
+		xf->readdata[i] = spiword(self->bits_per_word, MAX3100_CMD_READ_DATA);
+		xf->wr[i].tx_buf = (unsigned long)&xf->tx[i];
+		xf->rd[i].tx_buf = (unsigned long)&xf->readdata[i];
+		xf->wr[i].rx_buf = xf->rd[i].rx_buf = (unsigned long)&xf->rx[i];
+		xf->wr[i].len = xf->rd[i].len = 2;
+		xf->wr[i].speed_hz = xf->rd[i].speed_hz = self->max_speed_hz;
+		xf->wr[i].bits_per_word = xf->rd[i].bits_per_word = self->bits_per_word;
+		xf->wr[i].cs_change = xf->rd[i].cs_change = 1;
+	}
+}
 
-PyDoc_STRVAR(MAX3100_ObjectType_doc,
-	"MAX3100([bus],[client],[crystal],[baud],[spispeed],[maxmisses]) -> Serial\n\n"
-	"Return a new MAX3100 object that is (optionally) connected to the\n"
-	"specified SPI device interface.\n");
+/* Clock the first n words of xf->wr, or xf->rd if reading, as one
+   message. The last word must not have cs_change set, which would keep
+   CS asserted after the message instead. */
+static inline int spiwords(MAX3100_Object *self, int n, int reading) {
+	struct spi_ioc_transfer *xfer = reading ? self->xf->rd : self->xf->wr;
+	int rc;
+	xfer[n-1].cs_change = 0;
+	rc = spimessage(self, xfer, n);
+	xfer[n-1].cs_change = 1;
+	return rc;
+}
 
-static
-PyObject *MAX3100_enter(PyObject *self, PyObject *args)
-{
+// One word; a failed transfer reads as 0.
+uint16_t transfer16(MAX3100_Object *self, uint16_t send) {
+	self->xf->tx[0] = spiword(self->bits_per_word, send);
+	spiwords(self, 1, 0);
+	return spiword(self->bits_per_word, self->xf->rx[0]);
+}
+
+// Clock n 16-bit words in one SPI message, releasing CS between words.
+int transfern(MAX3100_Object *self, const uint16_t *send, uint16_t *recv, int n) {
+	MAX3100_Xfer *xf = self->xf;
+	int rc;
+	for (int i=0; i<n; i++) {
+		xf->tx[i] = spiword(self->bits_per_word, send[i]);
+	}
+	rc = spiwords(self, n, 0);
+	for (int i=0; i<n; i++) {
+		recv[i] = spiword(self->bits_per_word, xf->rx[i]);
+	}
+	return rc;
+}
+
+/* Raise the first SPI failure since the last call, whichever thread ran
+   into it. GIL held; -1 with IOError set if there was one. */
+static int spi_check(MAX3100_Object *self) {
+	int err = __atomic_exchange_n(&self->spi_errno, 0, __ATOMIC_ACQ_REL);
+	if (err) {
+		errno = err;
+		PyErr_SetFromErrno(PyExc_IOError);
+		return -1;
+	}
+	return 0;
+}
+
+static inline uint32_t ringcount(MAX3100_Object *self) {
+	return LOAD_ACQUIRE(&self->bufend) - LOAD_ACQUIRE(&self->bufst);
+}
+
+static inline uint32_t ringfree(MAX3100_Object *self) {
+	return self->bufsize - ringcount(self);
+}
+
+/* Producer side, lock held. A consumer only ever moves bufst forward with
+   a compare-and-swap, so under OVERFLOW_DROP_OLDEST the producer can make
+   room by doing the same; a consumer that raced with it retries. */
+static inline void ringput(MAX3100_Object *self, uint8_t uch) {
+	uint32_t end = self->bufend;
+	uint32_t st = LOAD_ACQUIRE(&self->bufst);
+	self->stats.rx_chars++;
+	if (end - st >= self->bufsize) {
+		self->stats.overflows++;
+		if (self->overflow != OVERFLOW_DROP_OLDEST) {
+			return;
+		}
+		while (end - st >= self->bufsize &&
+		       !__atomic_compare_exchange_n(&self->bufst, &st, st + 1, 0,
+		                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			;
+	}
+	self->buffer[end & self->bufmask] = uch;
+	// fprintf(stderr, "store - %04d: %02X\n", end & self->bufmask, uch);
+	STORE_RELEASE(&self->bufend, end + 1);
+	if (end + 1 - st > self->stats.high_water) {
+		self->stats.high_water = end + 1 - st;
+	}
+}
+
+// Wake anyone waiting on fileno() if characters arrived since end was
+// sampled. Producer side, lock held.
+static inline void ringnotify(MAX3100_Object *self, uint32_t end) {
+	uint64_t one = 1;
+	if (self->efd != -1 && self->bufend != end) {
+		ssize_t ignored = write(self->efd, &one, sizeof one);
+		(void)ignored;
+	}
+}
+
+// Copy up to n buffered characters out of the ring, returns the number copied.
+static uint32_t ringget(MAX3100_Object *self, uint8_t *dst, uint32_t n) {
+	uint32_t st = LOAD_ACQUIRE(&self->bufst);
+	uint32_t count, first, want;
+	do {
+		count = LOAD_ACQUIRE(&self->bufend) - st;
+		want = (n > count) ? count : n;
+		first = self->bufsize - (st & self->bufmask);
+		if (first > want) {
+			first = want;
+		}
+		memcpy(dst, self->buffer + (st & self->bufmask), first);
+		memcpy(dst + first, self->buffer, want - first);
+	} while (!__atomic_compare_exchange_n(&self->bufst, &st, st + want, 0,
+	                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	return want;
+}
+
+// Drop n buffered characters.
+static void ringskip(MAX3100_Object *self, uint32_t n) {
+	__atomic_fetch_add(&self->bufst, n, __ATOMIC_ACQ_REL);
+}
+
+/* Find pat in the first count buffered characters, starting at offset
+   from. Returns the offset of the match relative to the read position,
+   or -1. The buffered data may wrap, so search the part up to the end of
+   the ring, then the few bytes either side of the wrap point, then the
+   part at the start of the ring. patlen must be <= MAX_PATTERN. */
+static int32_t ringfind(MAX3100_Object *self, const uint8_t *pat, uint32_t patlen,
+                        uint32_t from, uint32_t count) {
+	uint32_t st = LOAD_ACQUIRE(&self->bufst) & self->bufmask;
+	uint32_t len1, len2, a, b, s0, from2;
+	uint8_t tmp[2*MAX_PATTERN];
+	const uint8_t *p;
+	if (patlen == 0 || from + patlen > count) {
+		return -1;
+	}
+	len1 = self->bufsize - st;
+	if (len1 > count) {
+		len1 = count;
+	}
+	len2 = count - len1;
+	if (from < len1) {
+		p = memmem(self->buffer + st + from, len1 - from, pat, patlen);
+		if (p) {
+			return p - (self->buffer + st);
+		}
+	}
+	if (len2 > 0 && patlen > 1) {
+		s0 = (len1 >= patlen - 1) ? len1 - (patlen - 1) : 0;
+		if (s0 < from) {
+			s0 = from;
+		}
+		if (s0 < len1) {
+			a = len1 - s0;
+			b = (len2 < patlen - 1) ? len2 : patlen - 1;
+			memcpy(tmp, self->buffer + st + s0, a);
+			memcpy(tmp + a, self->buffer, b);
+			p = memmem(tmp, a + b, pat, patlen);
+			if (p) {
+				return s0 + (p - tmp);
+			}
+		}
+	}
+	from2 = (from > len1) ? from - len1 : 0;
+	if (len2 >= from2 + patlen) {
+		p = memmem(self->buffer + from2, len2 - from2, pat, patlen);
+		if (p) {
+			return len1 + (p - self->buffer);
+		}
+	}
+	return -1;
+}
+
+// IRQ is requested active low, so 1 means the MAX3100 has data for us
+// (only RM is unmasked, see open()).
+static int irq_asserted(MAX3100_Object *self) {
+	struct gpiohandle_data data;
+	if (ioctl(self->irq_fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data) == -1) {
+		return 1;
+	}
+	return data.values[0];
+}
+
+// Block until the IRQ line is asserted or timeout_ms passes (-1 waits
+// forever). Consumes any queued edge events.
+static void waitirq(MAX3100_Object *self, int timeout_ms) {
+	struct gpioevent_data events[16];
+	struct pollfd pfd;
+	if (irq_asserted(self)) {
+		return;
+	}
+	pfd.fd = self->irq_fd;
+	pfd.events = POLLIN | POLLPRI;
+	if (poll(&pfd, 1, timeout_ms) > 0) {
+		// the line level is what we act on, just discard the edges
+		ssize_t ignored = read(self->irq_fd, events, sizeof events);
+		(void)ignored;
+	}
+}
+
+// Store a received character, counting parity errors.
+static inline void rxchar(MAX3100_Object *self, uint16_t r) {
+	if (self->parity != PARITY_NONE && (r&MAX3100_DATA_PR) != paritybit(self, r&0xff)) {
+		self->stats.parity_errors++;
+	}
+	ringput(self, (uint8_t)(r&datamask(self)));
+}
+
+/* Drive the RTS output without transmitting. Like any WRITE_DATA this
+   reads out a pending character, which goes into the ring. */
+static void setrts(MAX3100_Object *self, uint16_t rts) {
+	uint16_t tx = MAX3100_CMD_WRITE_DATA|MAX3100_DATA_TE|rts, rx;
+	self->rts = rts;
+	transfern(self, &tx, &rx, 1);
+	self->cts = rx&MAX3100_DATA_CTS;
+	if (rx&MAX3100_CONF_R) {
+		rxchar(self, rx);
+	}
+}
+
+/* Automatic flow control: hold off the far end once the ring is three
+   quarters full, let it carry on when the consumer has brought it down
+   to half. */
+static void flowcontrol(MAX3100_Object *self) {
+	uint32_t count = ringcount(self);
+	if (self->rts && count >= self->bufsize - self->bufsize/4) {
+		setrts(self, 0);
+	} else if (!self->rts && count <= self->bufsize/2) {
+		setrts(self, MAX3100_DATA_RTS);
+	}
+}
+
+/* How long after the last character adaptive polling keeps looking for
+   more: two expected gaps, where the gap is the character time at the
+   configured baud or the recent average gap if the sender is slower,
+   capped at half a FIFO's worth of characters. */
+static int64_t adaptive_window(MAX3100_Object *self) {
+	int64_t gap = self->rx_gap_ns;
+	if (gap < self->chartime_ns) {
+		gap = self->chartime_ns;
+	}
+	if (gap > self->chartime_ns*MAX3100_FIFO/4) {
+		gap = self->chartime_ns*MAX3100_FIFO/4;
+	}
+	return 2*gap;
+}
+
+/* poll='predictive': characters arrive no faster than one per character
+   time, so since the FIFO was last seen empty at most ceil(elapsed /
+   chartime) of them can be waiting, and never more than the FIFO holds.
+   Clock exactly that many READ_DATA words in one message. Only if every
+   one of them carried a character may there be more, so go again. */
+static void drainpredicted(MAX3100_Object *self) {
+	int depth = (self->conf & MAX3100_CONF_FEN) ? 1 : MAX3100_FIFO;
+	int64_t start, elapsed;
+	uint32_t room;
+	uint16_t r;
+	int n, got;
+	while (1) {
+		start = now_ns();
+		elapsed = start - self->last_empty_ns;
+		if (self->last_empty_ns == 0 || elapsed >= depth*self->chartime_ns) {
+			n = depth;
+		} else {
+			n = (elapsed + self->chartime_ns - 1)/self->chartime_ns;
+		}
+		if (n == 0) {
+			return;
+		}
+		if (self->overflow == OVERFLOW_BLOCK) {
+			if ((room = ringfree(self)) == 0) {
+				return;
+			}
+			if (room < (uint32_t)n) {
+				n = room;
+			}
+		}
+		if (spiwords(self, n, 1) == -1) {
+			return;
+		}
+		got = 0;
+		for (int i=0; i<n; i++) {
+			r = spiword(self->bits_per_word, self->xf->rx[i]);
+			self->cts = r&MAX3100_DATA_CTS;
+			if (r&MAX3100_CONF_R) {
+				rxchar(self, r);
+				got++;
+			} else {
+				self->stats.empty_words++;
+			}
+		}
+		if (got < n) {
+			// empty by the time of the first miss, which is after start
+			self->last_empty_ns = start;
+			return;
+		}
+	}
+}
+
+void fetchbytes(MAX3100_Object *self) {
+	/* Clock batch READ_DATA words per ioctl. Each word is its own
+	   spi_ioc_transfer with cs_change set, so CS is released between
+	   words as the MAX3100 requires, but the whole batch is one syscall. */
+	uint8_t n = self->batch;
+	uint16_t r;
+	uint8_t misses = 0;
+	uint32_t room;
+	uint32_t end = self->bufend;
+	int got;
+	int64_t now, idle, window;
+	int irq = (self->irq_fd != -1);
+	int adaptive = (self->pollmode == POLL_ADAPTIVE);
+	self->stats.polls++;
+	if (self->rtscts) {
+		flowcontrol(self);
+	}
+	if (irq && !irq_asserted(self)) {
+		ringnotify(self, end);
+		return;
+	}
+	if (self->pollmode == POLL_PREDICTIVE) {
+		drainpredicted(self);
+		goto done;
+	}
+	while (adaptive || misses < self->maxmisses) {
+		if (irq && misses && !irq_asserted(self)) {
+			// FIFO seen empty and IRQ released, nothing left to clock out
+			break;
+		}
+		if (self->overflow == OVERFLOW_BLOCK) {
+			// only pull out what the ring has room for
+			if ((room = ringfree(self)) == 0) {
+				break;
+			}
+			if (room < n) {
+				n = room;
+			}
+		}
+		if (spiwords(self, n, 1) == -1) {
+			break;
+		}
+		got = 0;
+		for (int i=0; i<n; i++) {
+			r = spiword(self->bits_per_word, self->xf->rx[i]);
+			self->cts = r&MAX3100_DATA_CTS;
+			if (r&MAX3100_CONF_R) {
+				rxchar(self, r);
+				misses = 0;
+				got++;
+			} else {
+				self->stats.empty_words++;
+				if (misses < 255) {
+					misses += 1;
+				}
+			}
+		}
+		if (!adaptive) {
+			continue;
+		}
+		now = now_ns();
+		if (got) {
+			idle = now - self->last_rx_ns;
+			if (idle < self->chartime_ns*MAX3100_FIFO*2) {
+				self->rx_gap_ns = (7*self->rx_gap_ns + idle/got)/8;
+			}
+			self->last_rx_ns = now;
+		}
+		if (!misses) {
+			// every word had data, the FIFO may hold more
+			continue;
+		}
+		// Give a burst in progress a chance to deliver its next character,
+		// stop once the line has been quiet for longer than expected.
+		window = adaptive_window(self);
+		idle = now - self->last_rx_ns;
+		if (idle >= window) {
+			break;
+		}
+		sleep_ns((window - idle < self->chartime_ns) ? window - idle : self->chartime_ns);
+	}
+done:
+	if (self->rtscts) {
+		flowcontrol(self);
+	}
+	ringnotify(self, end);
+}
+
+// Store the received character carried by a data response word.
+static inline int capture(MAX3100_Object *self, uint16_t r) {
+	self->cts = r&MAX3100_DATA_CTS;
+	if (r&MAX3100_CONF_R) {
+		rxchar(self, r);
+		return 1;
+	}
+	return 0;
+}
+
+/* Transmit len characters. Every WRITE_DATA is sent together with a
+   trailing READ_DATA in the same ioctl; the trailing word reports T (is
+   the transmit buffer free again) so the next character can usually go
+   out without a separate status poll. When the buffer is still full we
+   sleep until the character ahead of it should be off the wire, based on
+   the baud rate. With rtscts, a deasserted CTS in the trailing word holds
+   the next character back the same way. Every response word is a receive
+   slot: a character in it goes straight into the ring, so traffic coming
+   the other way is collected at no extra cost and there is no separate
+   drain afterwards. Gives up rather than wait past deadline (-1 for
+   never), or on an SPI failure, and returns how many characters went
+   out. */
+size_t putbytes(MAX3100_Object *self, const uint8_t *buf, size_t len, int64_t deadline) {
+	uint16_t tx[2], rx[2];
+	int ready = 0, received = 0;
+	int64_t now, free_at = 0;
+	size_t ii = 0;
+	uint32_t end = self->bufend;
+	uint16_t txready = MAX3100_CONF_T | (self->rtscts ? MAX3100_DATA_CTS : 0);
+	while (ii < len) {
+		if (!ready) {
+			now = now_ns();
+			if (free_at > now) {
+				if (deadline >= 0 && free_at > deadline) {
+					// the MAX3100 won't take another character in time
+					break;
+				}
+				sleep_ns(free_at - now);
+			}
+			tx[0] = MAX3100_CMD_READ_DATA;
+			if (transfern(self, tx, rx, 1) == -1) {
+				break;
+			}
+			received |= capture(self, rx[0]);
+			ready = (rx[0]&txready) == txready;
+			if (!ready) {
+				self->stats.tx_waits++;
+				// the far end takes a while to clear CTS
+				free_at = now_ns() + ((rx[0]&MAX3100_CONF_T) ? self->chartime_ns : self->chartime_ns/8);
+			}
+			continue;
+		}
+		tx[0] = MAX3100_CMD_WRITE_DATA|self->rts|paritybit(self, buf[ii])|buf[ii];
+		tx[1] = MAX3100_CMD_READ_DATA;
+		if (transfern(self, tx, rx, 2) == -1) {
+			break;
+		}
+		now = now_ns();
+		// The character either starts shifting out now or waits in the
+		// transmit buffer for the one ahead of it to finish.
+		if (self->tx_shift_end <= now) {
+			free_at = now;
+			self->tx_shift_end = now + self->chartime_ns;
+		} else {
+			free_at = self->tx_shift_end;
+			self->tx_shift_end += self->chartime_ns;
+		}
+		received |= capture(self, rx[0]);
+		received |= capture(self, rx[1]);
+		ready = (rx[1]&txready) == txready;
+		self->stats.tx_chars++;
+		ii++;
+	}
+	if (received) {
+		ringnotify(self, end);
+	}
+	return ii;
+}
+
+static inline uint32_t txcount(MAX3100_Object *self) {
+	return LOAD_ACQUIRE(&self->txend) - LOAD_ACQUIRE(&self->txst);
+}
+
+/* Hand queued characters to putbytes(), lock held. Returns how many are
+   still queued when deadline came. */
+static uint32_t txsend(MAX3100_Object *self, int64_t deadline) {
+	uint32_t st = self->txst;
+	uint32_t count = LOAD_ACQUIRE(&self->txend) - st;
+	uint32_t first;
+	size_t sent;
+	while (count) {
+		first = self->txsize - (st & self->txmask);
+		if (first > count) {
+			first = count;
+		}
+		sent = putbytes(self, self->txbuf + (st & self->txmask), first, deadline);
+		st += sent;
+		count -= sent;
+		STORE_RELEASE(&self->txst, st);
+		if (sent < first) {
+			break;
+		}
+	}
+	return count;
+}
+
+/* Background side of the transmit queue: send what the MAX3100 takes
+   without waiting, lock held. Returns how long until it may take the
+   next character, 0 if the queue is empty. */
+static int64_t txdrain(MAX3100_Object *self) {
+	int64_t wait;
+	if (self->txbuf == NULL || txsend(self, now_ns()) == 0) {
+		return 0;
+	}
+	// the holding register empties as the character ahead finishes
+	wait = self->tx_shift_end - self->chartime_ns - now_ns();
+	return (wait > self->chartime_ns/8) ? wait : self->chartime_ns/8;
+}
+
+int available(MAX3100_Object *self) {
+	fetchbytes(self);
+	return ringcount(self);
+}
+
+void clear(MAX3100_Object *self) {
+	fetchbytes(self);
+	STORE_RELEASE(&self->bufst, LOAD_ACQUIRE(&self->bufend));
+}
+
+// Wait for more characters to (possibly) arrive, but not past deadline
+// (a CLOCK_MONOTONIC time in ns, -1 for none). Blocks on the IRQ line when
+// we own the bus and have one, otherwise sleeps for one character time.
+static void waitrx(MAX3100_Object *self, int64_t deadline) {
+	int64_t left = -1;
+	if (deadline >= 0) {
+		left = deadline - now_ns();
+		if (left <= 0) {
+			return;
+		}
+	}
+	if (self->irq_fd != -1 && !BACKGROUND_RX(self)) {
+		waitirq(self, left < 0 ? -1 : (int)((left + 999999)/1000000));
+	} else {
+		sleep_ns((left >= 0 && left < self->chartime_ns) ? left : self->chartime_ns);
+	}
+}
+
+/* capture(): a thread of its own takes received characters from the
+   ring, as its consumer, and stores them in a file with write() or into
+   an mmap of it. It takes no lock, so a slow disk only fills the ring
+   and never holds up whoever drains the FIFO. Set up and torn down with
+   ctllock held; readers see self->capture set and stay away. */
+typedef struct MAX3100_Capture {
+	int fd;
+	uint8_t *map;	/* the mmap'ed file, NULL to use write() */
+	uint64_t size;	/* stop after this many, 0 for no limit (write() only) */
+	uint64_t done;	/* bytes captured */
+	int active;	/* still taking characters */
+	int stop;	/* asked to finish by capture_finish() */
+	int error;	/* errno of a failed write, which ends the capture */
+	pthread_t thread;
+} MAX3100_Capture;
+
+static void *capturethread(void *arg) {
+	MAX3100_Object *self = (MAX3100_Object *)arg;
+	MAX3100_Capture *cap = self->capture;
+	uint32_t st, count, first;
+	ssize_t n;
+	while (!LOAD_ACQUIRE(&cap->stop)) {
+		if ((count = ringcount(self)) == 0) {
+			sleep_ns(self->chartime_ns*MAX3100_FIFO/2);
+			continue;
+		}
+		st = LOAD_ACQUIRE(&self->bufst);
+		first = self->bufsize - (st & self->bufmask);
+		if (first > count) {
+			first = count;
+		}
+		if (cap->size && cap->done + first > cap->size) {
+			first = cap->size - cap->done;
+		}
+		if (cap->map) {
+			memcpy(cap->map + cap->done, self->buffer + (st & self->bufmask), first);
+			n = first;
+		} else if ((n = write(cap->fd, self->buffer + (st & self->bufmask), first)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			cap->error = errno;
+			break;
+		}
+		ringskip(self, n);
+		STORE_RELEASE(&cap->done, cap->done + n);
+		if (cap->size && cap->done == cap->size) {
+			break;
+		}
+	}
+	STORE_RELEASE(&cap->active, 0);
+	return NULL;
+}
+
+/* Stop, detach and close the capture. GIL and ctllock held. Returns its
+   errno, 0 if none. */
+static int capture_finish(MAX3100_Object *self, uint64_t *done) {
+	MAX3100_Capture *cap = self->capture;
+	int err;
+	if (cap == NULL) {
+		*done = 0;
+		return 0;
+	}
+	STORE_RELEASE(&cap->stop, 1);
+	Py_BEGIN_ALLOW_THREADS
+	pthread_join(cap->thread, NULL);
+	Py_END_ALLOW_THREADS
+	// the ring is the readers' again
+	STORE_RELEASE(&self->capture, NULL);
+	err = cap->error;
+	if (cap->map) {
+		if (msync(cap->map, cap->size, MS_SYNC) == -1 && !err) {
+			err = errno;
+		}
+		munmap(cap->map, cap->size);
+		// a capture stopped early leaves no zero filled tail
+		if (cap->done < cap->size && ftruncate(cap->fd, cap->done) == -1 && !err) {
+			err = errno;
+		}
+	}
+	if (close(cap->fd) == -1 && !err) {
+		err = errno;
+	}
+	*done = cap->done;
+	PyMem_RawFree(cap);
+	return err;
+}
+
+// Background I/O thread: keep the 8 character FIFO drained into the
+// ring, waking roughly every half FIFO's worth of character times, and
+// feed the transmitter from the transmit queue.
+static void *rxthread(void *arg) {
+	MAX3100_Object *self = (MAX3100_Object *)arg;
+	int64_t txwait;
+	int64_t late = -1;	/* of the last timed sleep, counted under the lock */
+	while (LOAD_ACQUIRE(&self->rx_running)) {
+		pthread_mutex_lock(&self->lock);
+		if (late >= 0) {
+			note_wakeup(&self->stats, late);
+		}
+		fetchbytes(self);
+		txwait = txdrain(self);
+		pthread_mutex_unlock(&self->lock);
+		late = -1;
+		if (txwait) {
+			// come back as soon as the next queued character can go
+			late = timed_sleep(txwait < self->chartime_ns*MAX3100_FIFO/2 ? txwait : self->chartime_ns*MAX3100_FIFO/2);
+		} else if (self->irq_fd != -1) {
+			// bounded so that close() is noticed promptly
+			waitirq(self, 50);
+		} else {
+			late = timed_sleep(self->chartime_ns*MAX3100_FIFO/2);
+		}
+	}
+	return NULL;
+}
+
+// Stop and join the receive thread, GIL must not be held.
+static void stop_rxthread(MAX3100_Object *self) {
+	if (self->rx_running) {
+		STORE_RELEASE(&self->rx_running, 0);
+		pthread_join(self->rx_thread, NULL);
+	}
+}
+
+static char *wrmsg_list0 = "Empty argument list.";
+static char *wrmsg_val = "Non-Int/Long value in arguments: %x.";
+static char *wrmsg_timeout = "Write timeout.";
+
+/* Queue len characters for the background thread, waiting for room as
+   needed. GIL and txlock held; -1 with TimeoutError set if deadline passes first,
+   or IOError if the thread can't reach the MAX3100. */
+static int
+txqueue(MAX3100_Object *self, const uint8_t *buf, size_t len, int64_t deadline)
+{
+	uint32_t end, room, n, first;
+	int64_t now;
+	while (len) {
+		end = self->txend;
+		room = self->txsize - (end - LOAD_ACQUIRE(&self->txst));
+		n = (len < room) ? len : room;
+		first = self->txsize - (end & self->txmask);
+		if (first > n) {
+			first = n;
+		}
+		memcpy(self->txbuf + (end & self->txmask), buf, first);
+		memcpy(self->txbuf, buf + first, n - first);
+		STORE_RELEASE(&self->txend, end + n);
+		buf += n;
+		len -= n;
+		if (len == 0) {
+			break;
+		}
+		if (spi_check(self) == -1) {
+			return -1;
+		}
+		now = now_ns();
+		if (deadline >= 0 && now >= deadline) {
+			PyErr_SetString(PyExc_TimeoutError, wrmsg_timeout);
+			return -1;
+		}
+		Py_BEGIN_ALLOW_THREADS
+		sleep_ns((deadline >= 0 && deadline - now < self->chartime_ns) ? deadline - now : self->chartime_ns);
+		Py_END_ALLOW_THREADS
+		if (PyErr_CheckSignals())
+			return -1;
+	}
+	return 0;
+}
+
+/* Send len characters for write(): queued if a background thread is
+   there to take them, otherwise straight out after anything still
+   queued. GIL and txlock held; -1 with an exception set on failure. */
+static int
+sendbytes(MAX3100_Object *self, const uint8_t *buf, size_t len, int64_t deadline)
+{
+	size_t sent = 0;
+	if (self->txbuf && BACKGROUND_RX(self)) {
+		return txqueue(self, buf, len, deadline);
+	}
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&self->lock);
+	if (self->txbuf == NULL || txsend(self, deadline) == 0) {
+		sent = putbytes(self, buf, len, deadline);
+	}
+	pthread_mutex_unlock(&self->lock);
+	Py_END_ALLOW_THREADS
+	if (spi_check(self) == -1) {
+		return -1;
+	}
+	if (sent < len) {
+		PyErr_SetString(PyExc_TimeoutError, wrmsg_timeout);
+		return -1;
+	}
+	return 0;
+}
+
+PyDoc_STRVAR(MAX3100_write_doc,
+	"write(data) -> number of bytes written\n\n"
+	"Write bytes via the MAX3100. data is any object supporting the buffer\n"
+	"protocol (bytes, bytearray, memoryview, array) or a sequence of ints,\n"
+	"of any length. Raises TimeoutError if write_timeout passes first.\n"
+	"If the device was opened with a txbufsize and a background thread\n"
+	"services it, data is queued and write() returns as soon as it fits;\n"
+	"flush() waits for it to go out.\n");
+
+static PyObject *
+MAX3100_writebytes_locked(MAX3100_Object *self, PyObject *args)
+{
+	Py_ssize_t	ii, len, chunk;
+	uint8_t	buf[WRITE_CHUNK];
+	PyObject	*obj;
+	PyObject	*seq;
+	Py_buffer	view;
+	char	wrmsg_text[4096];
+	int64_t	deadline = -1, wtimeout;
+	int	rc;
+
+	if (!PyArg_ParseTuple(args, "O:write", &obj))
+		return NULL;
+	if ((wtimeout = LOAD_ACQUIRE(&self->write_timeout_ns)) >= 0)
+		deadline = now_ns() + wtimeout;
+
+	if (PyObject_CheckBuffer(obj)) {
+		// Stream straight out of the exporter's memory, which stays
+		// pinned until the view is released.
+		if (PyObject_GetBuffer(obj, &view, PyBUF_SIMPLE) < 0)
+			return NULL;
+		if (view.len <= 0) {
+			PyBuffer_Release(&view);
+			PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+			return NULL;
+		}
+		rc = sendbytes(self, view.buf, view.len, deadline);
+		len = view.len;
+		PyBuffer_Release(&view);
+		if (rc == -1)
+			return NULL;
+		return PyLong_FromSsize_t(len);
+	}
+
+	// A copy, so no other thread can change or free items under us.
+	seq = PySequence_Tuple(obj);
+	if (!seq)
+		return NULL;
+	if (PyTuple_GET_SIZE(seq) <= 0) {
+		Py_DECREF(seq);
+		PyErr_SetString(PyExc_TypeError, wrmsg_list0);
+		return NULL;
+	}
+
+	// Convert and send WRITE_CHUNK values at a time.
+	for (ii = 0; ii < (len = PyTuple_GET_SIZE(seq)); ii += chunk) {
+		chunk = len - ii;
+		if (chunk > WRITE_CHUNK) {
+			chunk = WRITE_CHUNK;
+		}
+		for (Py_ssize_t jj = 0; jj < chunk; jj++) {
+			PyObject *val = PyTuple_GET_ITEM(seq, ii + jj);
+#if PY_MAJOR_VERSION < 3
+			if (PyInt_Check(val)) {
+				buf[jj] = (__u8)PyInt_AS_LONG(val);
+			} else
+#endif
+			{
+				if (PyLong_Check(val)) {
+					buf[jj] = (__u8)PyLong_AS_LONG(val);
+				} else {
+					Py_DECREF(seq);
+					snprintf(wrmsg_text, sizeof (wrmsg_text) - 1, wrmsg_val, val);
+					PyErr_SetString(PyExc_TypeError, wrmsg_text);
+					return NULL;
+				}
+			}
+		}
+
+		if (sendbytes(self, buf, chunk, deadline) == -1) {
+			Py_DECREF(seq);
+			return NULL;
+		}
+	}
+
+	Py_DECREF(seq);
+	
+	return PyLong_FromSsize_t(ii);
+}
+
+PyDoc_STRVAR(MAX3100_read_doc,
+	"read(length=0, timeout=<self.timeout>) -> [values]\n\n"
+	"Read length bytes from SPI device.\n  length > 0, blocking read for length characters\n  length == 0, non-blocking read as many as possible (depends on maxmisses)\n  length < 0, non-blocking read for at most length characters (depends on maxmisses)\n"
+	"A blocking read returns early with fewer characters once timeout seconds\n"
+	"have passed (None waits forever), or once inter_byte_timeout seconds pass\n"
+	"between characters after the first one.\n");
+
+// Parse a pyserial style timeout: None means wait forever (-1).
+static int
+parse_timeout(PyObject *obj, int64_t *ns)
+{
+	double val;
+	if (obj == Py_None) {
+		*ns = -1;
+		return 0;
+	}
+	val = PyFloat_AsDouble(obj);
+	if (val == -1.0 && PyErr_Occurred())
+		return -1;
+	if (val < 0) {
+		PyErr_SetString(PyExc_ValueError, "timeout must be None or non-negative.");
+		return -1;
+	}
+	*ns = (int64_t)(val*1e9);
+	return 0;
+}
+
+// Drain the FIFO into the ring unless the receive thread is doing so.
+// Called with the GIL held, releases it around the SPI traffic. -1 with
+// IOError set if the SPI bus failed, here or in the background thread.
+static int
+pollrx(MAX3100_Object *self)
+{
+	if (!BACKGROUND_RX(self)) {
+		Py_BEGIN_ALLOW_THREADS
+		pthread_mutex_lock(&self->lock);
+		fetchbytes(self);
+		pthread_mutex_unlock(&self->lock);
+		Py_END_ALLOW_THREADS
+	}
+	return spi_check(self);
+}
+
+/* Wait for and copy up to len characters into dst, honouring timeout and
+   inter_byte_timeout; with partial, stop waiting once there are any, as
+   a raw stream's readinto() does. Called with the GIL and rxlock held;
+   rxlock, not the GIL, keeps consumers serialized against each other.
+   Returns the number stored, or -1 with an exception set. */
+static Py_ssize_t
+readring(MAX3100_Object *self, uint8_t *dst, Py_ssize_t len, int64_t timeout, int partial)
+{
+	Py_ssize_t ii = 0, got;
+	int64_t deadline = -1, last, now, until;
+	int64_t gap = LOAD_ACQUIRE(&self->inter_byte_timeout_ns);
+
+	last = now_ns();
+	if (timeout >= 0) {
+		deadline = last + timeout;
+	}
+	while (1) {
+		if (pollrx(self) == -1)
+			return -1;
+		got = ringget(self, dst + ii, (len - ii) > self->bufsize ? self->bufsize : (uint32_t)(len - ii));
+		ii += got;
+		if (ii >= len || (partial && ii > 0)) {
+			break;
+		}
+		now = now_ns();
+		if (got > 0) {
+			last = now;
+		}
+		until = deadline;
+		if (ii > 0 && gap >= 0) {
+			if (until < 0 || last + gap < until) {
+				until = last + gap;
+			}
+		}
+		if (until >= 0 && now >= until) {
+			break;
+		}
+		// The lock is not held while we wait, so writers on other
+		// threads can get at the SPI bus.
+		Py_BEGIN_ALLOW_THREADS
+		waitrx(self, until);
+		Py_END_ALLOW_THREADS
+		if (PyErr_CheckSignals())
+			return -1;
+	}
+	return ii;
+}
+
+static PyObject *
+MAX3100_readbytes_locked(MAX3100_Object *self, PyObject *args, PyObject *kwds)
+{
+	Py_ssize_t len=0, got;
+	PyObject *timeout_obj = NULL;
+	PyObject *result;
+	int64_t timeout = LOAD_ACQUIRE(&self->timeout_ns);
+	
+	static char *kwlist[] = {"length", "timeout", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|nO:read", kwlist, &len, &timeout_obj))
+		return NULL;
+	if (timeout_obj && parse_timeout(timeout_obj, &timeout) < 0)
+		return NULL;
+	
+	if (len <= 0) {
+		// Non-blocking, size the result by what is buffered after draining.
+		len = -len;
+		if (pollrx(self) == -1)
+			return NULL;
+		got = ringcount(self);
+		if (len == 0 || got < len) {
+			len = got;
+		}
+		if ((result = PyBytes_FromStringAndSize(NULL, len)) == NULL)
+			return NULL;
+		ringget(self, (uint8_t *)PyBytes_AS_STRING(result), len);
+		return result;
+	}
+
+	// Blocking, read straight into the result object.
+	if ((result = PyBytes_FromStringAndSize(NULL, len)) == NULL)
+		return NULL;
+	got = readring(self, (uint8_t *)PyBytes_AS_STRING(result), len, timeout, 0);
+	if (got < 0) {
+		Py_DECREF(result);
+		return NULL;
+	}
+	if (got < len && _PyBytes_Resize(&result, got) < 0)
+		return NULL;
+	return result;
+}
+
+PyDoc_STRVAR(MAX3100_flush_doc,
+	"flush() -> None\n\n"
+	"Wait until everything written, queued or not, is off the wire.\n");
+
+static PyObject *
+MAX3100_flush(MAX3100_Object *self)
+{
+	uint32_t pending;
+	int64_t now, shift_end;
+	while (1) {
+		pending = (self->txbuf != NULL) ? txcount(self) : 0;
+		ACQUIRE_LOCK(self);
+		shift_end = self->tx_shift_end;
+		RELEASE_LOCK(self);
+		now = now_ns();
+		if (pending == 0 && shift_end <= now)
+			break;
+		Py_BEGIN_ALLOW_THREADS
+		if (pending && !BACKGROUND_RX(self)) {
+			pthread_mutex_lock(&self->lock);
+			txsend(self, -1);
+			pthread_mutex_unlock(&self->lock);
+		} else {
+			sleep_ns((pending || shift_end - now > self->chartime_ns) ? self->chartime_ns : shift_end - now);
+		}
+		Py_END_ALLOW_THREADS
+		if (spi_check(self) == -1 || PyErr_CheckSignals())
+			return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(MAX3100_transfer_doc,
+	"transfer(data, rxlen=-1, timeout=None) -> bytes\n\n"
+	"Full duplex exchange: write data (any buffer protocol object) and\n"
+	"return the rxlen characters (default len(data)) received, collecting\n"
+	"them from the same SPI words that carry the transmitted characters.\n"
+	"Characters buffered before the call come first; clear() beforehand\n"
+	"for a clean exchange. Once data is sent, waits as read() does for the\n"
+	"rest, up to timeout (default the timeout property) and may return\n"
+	"fewer characters. Raises TimeoutError if write_timeout passes before\n"
+	"data has gone out.\n");
+
+static PyObject *
+MAX3100_transfer_locked(MAX3100_Object *self, PyObject *args, PyObject *kwds)
+{
+	Py_buffer view;
+	Py_ssize_t rxlen = -1, off = 0, got = 0, n, want, chunk;
+	PyObject *timeout_obj = NULL;
+	PyObject *result = NULL;
+	int64_t timeout = LOAD_ACQUIRE(&self->timeout_ns), deadline = -1, wtimeout;
+	const uint8_t *src;
+	uint8_t *dst;
+	size_t sent;
+	static char *kwlist[] = {"data", "rxlen", "timeout", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|nO:transfer", kwlist, &view, &rxlen, &timeout_obj))
+		return NULL;
+	if (timeout_obj && parse_timeout(timeout_obj, &timeout) < 0)
+		goto done;
+	if (rxlen < 0)
+		rxlen = view.len;
+	if ((result = PyBytes_FromStringAndSize(NULL, rxlen)) == NULL)
+		goto done;
+	src = view.buf;
+	dst = (uint8_t *)PyBytes_AS_STRING(result);
+	if ((wtimeout = LOAD_ACQUIRE(&self->write_timeout_ns)) >= 0)
+		deadline = now_ns() + wtimeout;
+
+	// Send in pieces no bigger than half the ring and empty it in between,
+	// so a long exchange can't overflow it.
+	chunk = (self->bufsize/2 < WRITE_CHUNK) ? self->bufsize/2 : WRITE_CHUNK;
+	while (off < view.len) {
+		n = (view.len - off < chunk) ? view.len - off : chunk;
+		Py_BEGIN_ALLOW_THREADS
+		pthread_mutex_lock(&self->lock);
+		// anything still queued goes first
+		sent = (txsend(self, deadline) == 0) ? putbytes(self, src + off, n, deadline) : 0;
+		pthread_mutex_unlock(&self->lock);
+		Py_END_ALLOW_THREADS
+		if (spi_check(self) == -1) {
+			Py_CLEAR(result);
+			goto done;
+		}
+		off += sent;
+		want = rxlen - got;
+		got += ringget(self, dst + got, (want > self->bufsize) ? self->bufsize : (uint32_t)want);
+		if ((Py_ssize_t)sent < n) {
+			PyErr_SetString(PyExc_TimeoutError, wrmsg_timeout);
+			Py_CLEAR(result);
+			goto done;
+		}
+	}
+	if (got < rxlen) {
+		if ((n = readring(self, dst + got, rxlen - got, timeout, 0)) < 0) {
+			Py_CLEAR(result);
+			goto done;
+		}
+		got += n;
+	}
+	if (got < rxlen)
+		_PyBytes_Resize(&result, got);
+done:
+	PyBuffer_Release(&view);
+	return result;
+}
+
+PyDoc_STRVAR(MAX3100_readinto_doc,
+	"readinto(buffer, timeout=<self.timeout>) -> number of bytes read\n\n"
+	"Read into a writable buffer (bytearray, memoryview, array, ...) straight\n"
+	"from the receive buffer. As for a raw io stream, waits (up to timeout)\n"
+	"for at least one character, then returns what is there without waiting\n"
+	"to fill the buffer; io.BufferedReader(dev) builds on this. 0 if none\n"
+	"arrived in time.\n");
+
+static PyObject *
+MAX3100_readinto_locked(MAX3100_Object *self, PyObject *args, PyObject *kwds)
+{
+	Py_buffer view;
+	Py_ssize_t got;
+	PyObject *timeout_obj = NULL;
+	int64_t timeout = LOAD_ACQUIRE(&self->timeout_ns);
+
+	static char *kwlist[] = {"buffer", "timeout", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "w*|O:readinto", kwlist, &view, &timeout_obj))
+		return NULL;
+	if (timeout_obj && parse_timeout(timeout_obj, &timeout) < 0) {
+		PyBuffer_Release(&view);
+		return NULL;
+	}
+	got = 0;
+	if (view.len > 0) {
+		got = readring(self, view.buf, view.len, timeout, 1);
+	}
+	PyBuffer_Release(&view);
+	if (got < 0)
+		return NULL;
+	return PyLong_FromSsize_t(got);
+}
+
+// Take n buffered characters (n <= ringcount) as a bytes object.
+static PyObject *
+ringbytes(MAX3100_Object *self, uint32_t n)
+{
+	PyObject *result = PyBytes_FromStringAndSize(NULL, n);
+	if (result)
+		ringget(self, (uint8_t *)PyBytes_AS_STRING(result), n);
+	return result;
+}
+
+// Sleep between searches of the ring. Returns 1 once deadline has passed,
+// -1 if a signal handler raised.
+static int
+waitmore(MAX3100_Object *self, int64_t deadline)
+{
+	if (deadline >= 0 && now_ns() >= deadline)
+		return 1;
+	Py_BEGIN_ALLOW_THREADS
+	waitrx(self, deadline);
+	Py_END_ALLOW_THREADS
+	if (PyErr_CheckSignals())
+		return -1;
+	return 0;
+}
+
+static int
+get_pattern(PyObject *obj, Py_buffer *view, const char *what)
+{
+	if (PyObject_GetBuffer(obj, view, PyBUF_SIMPLE) < 0)
+		return -1;
+	if (view->len < 1 || view->len > MAX_PATTERN) {
+		PyErr_Format(PyExc_ValueError, "%s must be 1 to %d bytes.", what, MAX_PATTERN);
+		PyBuffer_Release(view);
+		return -1;
+	}
+	return 0;
+}
+
+PyDoc_STRVAR(MAX3100_read_until_doc,
+	"read_until(terminator=b'\\n', max=0, timeout=<self.timeout>) -> bytes\n\n"
+	"Return the buffered characters up to and including terminator, or the\n"
+	"first max characters if max > 0 and that many arrive without one.\n"
+	"If neither happens before timeout expires, returns b'' and leaves the\n"
+	"partial data buffered.\n");
+
+static PyObject *
+MAX3100_read_until_locked(MAX3100_Object *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *term_obj = NULL;
+	PyObject *timeout_obj = NULL;
+	PyObject *result = NULL;
+	Py_buffer term;
+	Py_ssize_t max = 0;
+	int64_t timeout = LOAD_ACQUIRE(&self->timeout_ns), deadline = -1;
+	uint32_t count, seen = 0, from = 0;
+	int32_t at;
+	int rc;
+
+	static char *kwlist[] = {"terminator", "max", "timeout", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OnO:read_until", kwlist,
+	                                 &term_obj, &max, &timeout_obj))
+		return NULL;
+	if (timeout_obj && parse_timeout(timeout_obj, &timeout) < 0)
+		return NULL;
+	if (term_obj == NULL) {
+		term_obj = PyBytes_FromStringAndSize("\n", 1);
+	} else {
+		Py_INCREF(term_obj);
+	}
+	rc = get_pattern(term_obj, &term, "terminator");
+	Py_DECREF(term_obj);
+	if (rc < 0)
+		return NULL;
+	if (max <= 0 || max > self->bufsize) {
+		max = self->bufsize;
+	}
+
+	if (timeout >= 0) {
+		deadline = now_ns() + timeout;
+	}
+	while (1) {
+		if (pollrx(self) == -1)
+			break;
+		count = ringcount(self);
+		if (count < seen) {
+			// another reader took data while we slept
+			from = 0;
+		}
+		seen = count;
+		at = ringfind(self, term.buf, term.len, from, count);
+		if (at >= 0 && at + term.len <= max) {
+			result = ringbytes(self, at + term.len);
+			break;
+		}
+		if (count >= max) {
+			result = ringbytes(self, max);
+			break;
+		}
+		// resume the search where a match could still start
+		from = (count >= term.len) ? count - term.len + 1 : 0;
+		if ((rc = waitmore(self, deadline)) != 0) {
+			if (rc > 0)
+				result = PyBytes_FromStringAndSize(NULL, 0);
+			break;
+		}
+	}
+	PyBuffer_Release(&term);
+	return result;
+}
+
+PyDoc_STRVAR(MAX3100_read_frame_doc,
+	"read_frame(header, length, timeout=<self.timeout>) -> bytes\n\n"
+	"Return a length character frame starting with header, e.g.\n"
+	"read_frame(b'\\xaa', 6) for uCAM commands. Characters before the header\n"
+	"are discarded. If no complete frame arrives before timeout expires,\n"
+	"returns b'' and leaves a partial frame buffered.\n");
+
+static PyObject *
+MAX3100_read_frame_locked(MAX3100_Object *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *header_obj;
+	PyObject *timeout_obj = NULL;
+	PyObject *result = NULL;
+	Py_buffer header;
+	Py_ssize_t length;
+	int64_t timeout = LOAD_ACQUIRE(&self->timeout_ns), deadline = -1;
+	uint32_t count;
+	int32_t at;
+	int rc;
+
+	static char *kwlist[] = {"header", "length", "timeout", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "On|O:read_frame", kwlist,
+	                                 &header_obj, &length, &timeout_obj))
+		return NULL;
+	if (timeout_obj && parse_timeout(timeout_obj, &timeout) < 0)
+		return NULL;
+	if (get_pattern(header_obj, &header, "header") < 0)
+		return NULL;
+	if (length < header.len || length > self->bufsize) {
+		PyErr_Format(PyExc_ValueError, "length must be between the header size and %u.", self->bufsize);
+		PyBuffer_Release(&header);
+		return NULL;
+	}
+
+	if (timeout >= 0) {
+		deadline = now_ns() + timeout;
+	}
+	while (1) {
+		if (pollrx(self) == -1)
+			break;
+		count = ringcount(self);
+		at = ringfind(self, header.buf, header.len, 0, count);
+		if (at < 0) {
+			// keep only a possible partial header at the end
+			if (count >= header.len) {
+				ringskip(self, count - header.len + 1);
+			}
+		} else {
+			ringskip(self, at);
+			if (count - at >= length) {
+				result = ringbytes(self, length);
+				break;
+			}
+		}
+		if ((rc = waitmore(self, deadline)) != 0) {
+			if (rc > 0)
+				result = PyBytes_FromStringAndSize(NULL, 0);
+			break;
+		}
+	}
+	PyBuffer_Release(&header);
+	return result;
+}
+
+/* Checksum kernels for the packet layer. The CRC tables are filled in
+   by crc_init() when the module is first imported. */
+static uint16_t crc16_table[256];
+static uint32_t crc32_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+	uint32_t c;
+	for (int i=0; i<256; i++) {
+		c = (uint32_t)i << 8;
+		for (int j=0; j<8; j++) {
+			c = (c & 0x8000) ? (c << 1) ^ 0x1021 : c << 1;
+		}
+		crc16_table[i] = (uint16_t)c;
+		c = i;
+		for (int j=0; j<8; j++) {
+			c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+		}
+		crc32_table[i] = c;
+	}
+}
+
+static uint32_t sum8(const uint8_t *p, size_t n) {
+	uint32_t s = 0;
+	while (n--) {
+		s += *p++;
+	}
+	return s & 0xff;
+}
+
+static uint32_t crc16(const uint8_t *p, size_t n) {
+	uint16_t crc = 0xffff;
+	while (n--) {
+		crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ *p++];
+	}
+	return crc;
+}
+
+static uint32_t crc32(const uint8_t *p, size_t n) {
+	uint32_t crc = 0xffffffff;
+#if defined(__ARM_FEATURE_CRC32) && __BYTE_ORDER == __LITTLE_ENDIAN
+	// the ARMv8 CRC32 instructions use the same polynomial as zlib
+	uint32_t w;
+	for (; n >= 4; p += 4, n -= 4) {
+		memcpy(&w, p, 4);
+		crc = __crc32w(crc, w);
+	}
+	while (n--) {
+		crc = __crc32b(crc, *p++);
+	}
+#else
+	while (n--) {
+		crc = crc32_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	}
+#endif
+	return ~crc;
+}
+
+static uint32_t checksum(uint8_t check, const uint8_t *p, size_t n) {
+	switch (check) {
+		case CHECK_SUM8: return sum8(p, n);
+		case CHECK_CRC16: return crc16(p, n);
+		case CHECK_CRC32: return crc32(p, n);
+		default: return 0;
+	}
+}
+
+// An unsigned size byte field.
+static uint32_t getfield(const uint8_t *p, uint32_t size, int bigendian) {
+	uint32_t v = 0;
+	for (uint32_t i=0; i<size; i++) {
+		v |= (uint32_t)p[bigendian ? i : size-1-i] << 8*(size-1-i);
+	}
+	return v;
+}
+
+// Copy n buffered characters (n <= ringcount) without taking them.
+static void ringpeek(MAX3100_Object *self, uint8_t *dst, uint32_t n) {
+	uint32_t st = LOAD_ACQUIRE(&self->bufst) & self->bufmask;
+	uint32_t first = self->bufsize - st;
+	if (first > n) {
+		first = n;
+	}
+	memcpy(dst, self->buffer + st, first);
+	memcpy(dst + first, self->buffer, n - first);
+}
+
+static int packet_valid(const MAX3100_PacketFormat *fmt, const uint8_t *pkt, uint32_t total) {
+	int64_t at;
+	if (fmt->check == CHECK_NONE) {
+		return 1;
+	}
+	at = (fmt->check_offset < 0) ? (int64_t)total + fmt->check_offset : fmt->check_offset;
+	if (at < 0 || at + fmt->check_size > total) {
+		return 0;
+	}
+	return getfield(pkt + at, fmt->check_size, fmt->bigendian) == checksum(fmt->check, pkt, at);
+}
+
+/* Consumer side: look for a packet at the start of the ring, dropping
+   whatever can't begin a valid one. Returns the size of a complete,
+   verified packet, copied into pkt (max_length bytes) but still
+   buffered, or 0 if more characters are needed. Needs no GIL or lock. */
+static uint32_t packet_scan(MAX3100_Object *self, const MAX3100_PacketFormat *fmt, uint8_t *pkt) {
+	uint32_t count, total;
+	uint32_t maxlen = (fmt->max_length < self->bufsize) ? fmt->max_length : self->bufsize;
+	int32_t at;
+	while (1) {
+		count = ringcount(self);
+		if (fmt->headerlen) {
+			at = ringfind(self, fmt->header, fmt->headerlen, 0, count);
+			if (at < 0) {
+				// keep only a possible partial header at the end
+				if (count >= fmt->headerlen) {
+					ringskip(self, count - fmt->headerlen + 1);
+				}
+				return 0;
+			}
+			ringskip(self, at);
+			count -= at;
+		}
+		if (count < fmt->min_length) {
+			return 0;
+		}
+		total = fmt->length;
+		if (total == 0) {
+			ringpeek(self, pkt, fmt->length_offset + fmt->length_size);
+			total = getfield(pkt + fmt->length_offset, fmt->length_size, fmt->bigendian) + fmt->overhead;
+		}
+		if (total >= fmt->min_length && total <= maxlen) {
+			if (count < total) {
+				return 0;
+			}
+			ringpeek(self, pkt, total);
+			if (packet_valid(fmt, pkt, total)) {
+				self->stats.packets++;
+				return total;
+			}
+		}
+		/* resynchronize on the next header; with no header a bad length or
+		   checksum says nothing about where the next packet starts, so
+		   try again one byte on */
+		self->stats.packet_errors++;
+		ringskip(self, 1);
+	}
+}
+
+PyDoc_STRVAR(MAX3100_set_packet_format_doc,
+	"set_packet_format(preset=None, header=b'', length=0, length_offset=-1, length_size=2,\n"
+	"                  overhead=0, max_length=0, checksum='none', checksum_offset=None,\n"
+	"                  byteorder='little') -> None\n\n"
+	"Describe the packets read_packet() returns. A packet starts with header\n"
+	"(or, with no header, where the previous one ended) and is either length\n"
+	"bytes long or as long as the unsigned length_size byte field at\n"
+	"length_offset says, plus overhead, up to max_length (default the buffer\n"
+	"size). checksum is 'none', 'sum8' (low byte of the byte sum), 'crc16'\n"
+	"(CCITT-FALSE) or 'crc32' (as zlib), stored at checksum_offset (negative\n"
+	"from the end, default the last bytes) over every byte before it.\n"
+	"Fields use byteorder. preset='ucam' is the uCAM image package: ID(2)\n"
+	"size(2) data verify(2), at most 512 bytes; other arguments override it.\n");
+
+static PyObject *
+MAX3100_set_packet_format(MAX3100_Object *self, PyObject *args, PyObject *kwds)
+{
+	const char *preset = NULL;
+	PyObject *header_obj = NULL;
+	Py_buffer header;
+	int length = INT_MIN, length_offset = INT_MIN, length_size = INT_MIN;
+	int overhead = INT_MIN, max_length = INT_MIN, check_offset = INT_MIN;
+	PyObject *check_offset_obj = NULL;
+	const char *checkstr = NULL, *byteorder = NULL;
+	MAX3100_PacketFormat fmt, *packet;
+	uint32_t need;
+	static char *kwlist[] = {"preset", "header", "length", "length_offset", "length_size",
+	                         "overhead", "max_length", "checksum", "checksum_offset", "byteorder", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|zOiiiiisOs:set_packet_format", kwlist,
+			&preset, &header_obj, &length, &length_offset, &length_size,
+			&overhead, &max_length, &checkstr, &check_offset_obj, &byteorder))
+		return NULL;
+	if (check_offset_obj && check_offset_obj != Py_None) {
+		check_offset = PyLong_AsLong(check_offset_obj);
+		if (check_offset == -1 && PyErr_Occurred())
+			return NULL;
+	}
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.length_size = 2;
+	fmt.check_offset = INT_MIN;
+	if (preset != NULL) {
+		if (strcmp(preset, "ucam") != 0) {
+			PyErr_SetString(PyExc_ValueError, "preset must be None or 'ucam'.");
+			return NULL;
+		}
+		fmt.length_offset = 2;
+		fmt.overhead = 6;
+		fmt.max_length = 512;
+		fmt.check = CHECK_SUM8;
+		fmt.check_offset = -2;
+	} else {
+		fmt.length_offset = (uint32_t)-1;
+	}
+	if (header_obj != NULL) {
+		if (PyObject_GetBuffer(header_obj, &header, PyBUF_SIMPLE) < 0)
+			return NULL;
+		if (header.len > MAX_PATTERN) {
+			PyBuffer_Release(&header);
+			PyErr_Format(PyExc_ValueError, "header must be at most %d bytes.", MAX_PATTERN);
+			return NULL;
+		}
+		memcpy(fmt.header, header.buf, header.len);
+		fmt.headerlen = header.len;
+		PyBuffer_Release(&header);
+	}
+	if (length != INT_MIN)
+		fmt.length = length;
+	if (length_offset != INT_MIN)
+		fmt.length_offset = length_offset;
+	if (length_size != INT_MIN)
+		fmt.length_size = length_size;
+	if (overhead != INT_MIN)
+		fmt.overhead = overhead;
+	if (max_length != INT_MIN)
+		fmt.max_length = max_length;
+	if (check_offset != INT_MIN)
+		fmt.check_offset = check_offset;
+	if (checkstr != NULL) {
+		if (strcmp(checkstr, "none") == 0) {
+			fmt.check = CHECK_NONE;
+		} else if (strcmp(checkstr, "sum8") == 0) {
+			fmt.check = CHECK_SUM8;
+		} else if (strcmp(checkstr, "crc16") == 0) {
+			fmt.check = CHECK_CRC16;
+		} else if (strcmp(checkstr, "crc32") == 0) {
+			fmt.check = CHECK_CRC32;
+		} else {
+			PyErr_SetString(PyExc_ValueError, "checksum must be 'none', 'sum8', 'crc16' or 'crc32'.");
+			return NULL;
+		}
+	}
+	if (byteorder == NULL || strcmp(byteorder, "little") == 0) {
+		fmt.bigendian = 0;
+	} else if (strcmp(byteorder, "big") == 0) {
+		fmt.bigendian = 1;
+	} else {
+		PyErr_SetString(PyExc_ValueError, "byteorder must be 'little' or 'big'.");
+		return NULL;
+	}
+
+	if (length < 0 && length != INT_MIN) {
+		PyErr_SetString(PyExc_ValueError, "length must not be negative.");
+		return NULL;
+	}
+	if (fmt.length == 0 && (int32_t)fmt.length_offset < 0) {
+		PyErr_SetString(PyExc_ValueError, "Give either a fixed length or a length_offset.");
+		return NULL;
+	}
+	if (fmt.length_size != 1 && fmt.length_size != 2 && fmt.length_size != 4) {
+		PyErr_SetString(PyExc_ValueError, "length_size must be 1, 2 or 4.");
+		return NULL;
+	}
+	fmt.check_size = (fmt.check == CHECK_CRC32) ? 4 : (fmt.check == CHECK_CRC16) ? 2 : (fmt.check == CHECK_SUM8) ? 1 : 0;
+	if (fmt.check_offset == INT_MIN)
+		fmt.check_offset = -(int32_t)fmt.check_size;
+	need = fmt.headerlen;
+	if (fmt.length == 0 && fmt.length_offset + fmt.length_size > need)
+		need = fmt.length_offset + fmt.length_size;
+	if (fmt.check != CHECK_NONE) {
+		if (fmt.check_offset >= 0 && fmt.check_offset + fmt.check_size > need)
+			need = fmt.check_offset + fmt.check_size;
+		if (fmt.check_offset < 0 && (uint32_t)-fmt.check_offset > need)
+			need = -fmt.check_offset;
+	}
+	if (need == 0)
+		need = 1;
+	if (fmt.max_length == 0)
+		fmt.max_length = fmt.length ? fmt.length : self->bufsize;
+	if (fmt.length && fmt.length < need) {
+		PyErr_SetString(PyExc_ValueError, "length is too short for the header and fields.");
+		return NULL;
+	}
+	if ((int32_t)fmt.max_length < (int32_t)need || (fmt.length && fmt.max_length < fmt.length)) {
+		PyErr_SetString(PyExc_ValueError, "max_length is too short for the header and fields.");
+		return NULL;
+	}
+	fmt.min_length = fmt.length ? fmt.length : need;
+
+	// not under a read_packet() or bulk_transfer() that is using it
+	ACQUIRE_RXLOCK(self);
+	if (fmt.max_length > self->bufsize || fmt.length > self->bufsize) {
+		RELEASE_RXLOCK(self);
+		PyErr_SetString(PyExc_ValueError, "Packets can't be longer than the receive buffer (bufsize).");
+		return NULL;
+	}
+	if ((packet = self->packet) == NULL && (packet = PyMem_RawMalloc(sizeof(fmt))) == NULL) {
+		RELEASE_RXLOCK(self);
+		return PyErr_NoMemory();
+	}
+	*packet = fmt;
+	self->packet = packet;
+	RELEASE_RXLOCK(self);
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(MAX3100_read_packet_doc,
+	"read_packet(timeout=<self.timeout>) -> bytes\n\n"
+	"Return the next complete packet whose checksum verifies, in the layout\n"
+	"given to set_packet_format(). Framing and checking happen in the\n"
+	"driver; invalid packets are discarded and counted in stats. If no valid\n"
+	"packet arrives before timeout expires, returns b'' and leaves a partial\n"
+	"packet buffered.\n");
+
+static PyObject *
+MAX3100_read_packet_locked(MAX3100_Object *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *timeout_obj = NULL;
+	PyObject *result = NULL;
+	int64_t timeout = LOAD_ACQUIRE(&self->timeout_ns), deadline = -1;
+	uint8_t *pkt;
+	uint32_t total;
+	int rc;
+
+	static char *kwlist[] = {"timeout", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:read_packet", kwlist, &timeout_obj))
+		return NULL;
+	if (timeout_obj && parse_timeout(timeout_obj, &timeout) < 0)
+		return NULL;
+	if (self->packet == NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "No packet format, see set_packet_format().");
+		return NULL;
+	}
+	if ((pkt = PyMem_Malloc(self->bufsize)) == NULL)
+		return PyErr_NoMemory();
+
+	if (timeout >= 0) {
+		deadline = now_ns() + timeout;
+	}
+	while (1) {
+		if (pollrx(self) == -1)
+			break;
+		if ((total = packet_scan(self, self->packet, pkt)) > 0) {
+			if ((result = PyBytes_FromStringAndSize((char *)pkt, total)) != NULL)
+				ringskip(self, total);
+			break;
+		}
+		if ((rc = waitmore(self, deadline)) != 0) {
+			if (rc > 0)
+				result = PyBytes_FromStringAndSize(NULL, 0);
+			break;
+		}
+	}
+	PyMem_Free(pkt);
+	return result;
+}
+
+/* A request/response bulk download, run by bulk_run() without the GIL:
+   send command once, then for each package an ack carrying its ID and
+   take the verified packet that comes back, retrying the ack on timeout.
+   Payloads go into buf or, if fd != -1, are written to fd. */
+typedef struct {
+	const uint8_t *command;
+	size_t command_len;
+	uint8_t ack[MAX_PATTERN];
+	size_t ack_len;
+	uint32_t id_offset;	/* ID field in the ack */
+	uint32_t id_size;
+	uint32_t first_id;
+	int32_t reply_id_offset;	/* ID field in the packet, -1 if not checked */
+	uint32_t reply_id_delta;	/* packet ID = ack ID + delta */
+	uint32_t count;	/* packages */
+	int retries;
+	int64_t timeout_ns;	/* per attempt */
+	const uint8_t *final;	/* sent after the last package */
+	size_t final_len;
+	uint8_t *buf;
+	size_t bufsize;
+	int fd;
+	// results
+	size_t written;
+	uint32_t done;	/* packages received */
+	int error;	/* BULK_* */
+	int err;	/* errno for BULK_OSERROR */
+} MAX3100_Bulk;
+
+#define BULK_OK       0
+#define BULK_TIMEOUT  1	/* a package never came, even after retries */
+#define BULK_OVERFLOW 2	/* buf is too small */
+#define BULK_OSERROR  3	/* writing to fd failed */
+#define BULK_SPI      4	/* see spi_errno */
+#define BULK_WRITE    5	/* the MAX3100 didn't take the ack in time */
+
+static void putfield(uint8_t *p, uint32_t size, int bigendian, uint32_t v) {
+	for (uint32_t i=0; i<size; i++) {
+		p[bigendian ? size-1-i : i] = (v >> 8*i) & 0xff;
+	}
+}
+
+// Send len characters straight out, after anything queued. No GIL.
+static int bulk_send(MAX3100_Object *self, const uint8_t *buf, size_t len, int64_t deadline) {
+	size_t sent = 0;
+	pthread_mutex_lock(&self->lock);
+	if (self->txbuf == NULL || txsend(self, deadline) == 0) {
+		sent = putbytes(self, buf, len, deadline);
+	}
+	pthread_mutex_unlock(&self->lock);
+	return (sent == len) ? 0 : -1;
+}
+
+// Drain the FIFO and drop everything buffered. No GIL.
+static void bulk_discard(MAX3100_Object *self) {
+	if (!BACKGROUND_RX(self)) {
+		pthread_mutex_lock(&self->lock);
+		fetchbytes(self);
+		pthread_mutex_unlock(&self->lock);
+	}
+	STORE_RELEASE(&self->bufst, LOAD_ACQUIRE(&self->bufend));
+}
+
+static int bulk_output(MAX3100_Bulk *job, const uint8_t *p, size_t n) {
+	ssize_t rc;
+	if (job->fd == -1) {
+		if (job->written + n > job->bufsize) {
+			job->error = BULK_OVERFLOW;
+			return -1;
+		}
+		memcpy(job->buf + job->written, p, n);
+		job->written += n;
+		return 0;
+	}
+	while (n) {
+		if ((rc = write(job->fd, p, n)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			job->error = BULK_OSERROR;
+			job->err = errno;
+			return -1;
+		}
+		p += rc;
+		n -= rc;
+		job->written += rc;
+	}
+	return 0;
+}
+
+/* Wait for the packet answering the ack for id, up to deadline. Returns
+   its size (it is in pkt and taken from the ring), or 0 on timeout or,
+   setting *failed, an SPI failure. Packets with another ID are dropped
+   as stale. */
+static uint32_t bulk_packet(MAX3100_Object *self, const MAX3100_Bulk *job, const MAX3100_PacketFormat *fmt,
+                            uint8_t *pkt, uint32_t id, int64_t deadline, int *failed) {
+	uint32_t total;
+	while (1) {
+		if (!BACKGROUND_RX(self)) {
+			pthread_mutex_lock(&self->lock);
+			fetchbytes(self);
+			pthread_mutex_unlock(&self->lock);
+		}
+		if (LOAD_ACQUIRE(&self->spi_errno)) {
+			*failed = 1;
+			return 0;
+		}
+		while ((total = packet_scan(self, fmt, pkt)) > 0) {
+			ringskip(self, total);
+			if (job->reply_id_offset < 0 ||
+			    ((uint32_t)job->reply_id_offset + job->id_size <= total &&
+			     getfield(pkt + job->reply_id_offset, job->id_size, fmt->bigendian)
+			       == ((id + job->reply_id_delta) & (job->id_size == 4 ? 0xffffffffU : (1U << 8*job->id_size) - 1)))) {
+				return total;
+			}
+			self->stats.packet_errors++;
+		}
+		if (now_ns() >= deadline) {
+			return 0;
+		}
+		waitrx(self, deadline);
+	}
+}
+
+static void bulk_run(MAX3100_Object *self, MAX3100_Bulk *job, uint8_t *pkt) {
+	const MAX3100_PacketFormat *fmt = self->packet;
+	uint32_t total, id, start, plen;
+	int64_t deadline;
+	int attempt, failed = 0;
+
+	bulk_discard(self);
+	if (job->command_len && bulk_send(self, job->command, job->command_len, now_ns() + job->timeout_ns) == -1) {
+		job->error = LOAD_ACQUIRE(&self->spi_errno) ? BULK_SPI : BULK_WRITE;
+		return;
+	}
+	for (job->done = 0; job->done < job->count; job->done++) {
+		id = job->first_id + job->done;
+		putfield(job->ack + job->id_offset, job->id_size, fmt->bigendian, id);
+		total = 0;
+		for (attempt = 0; attempt <= job->retries && total == 0 && !failed; attempt++) {
+			// anything left over would only get in the way of the reply
+			bulk_discard(self);
+			deadline = now_ns() + job->timeout_ns;
+			if (bulk_send(self, job->ack, job->ack_len, deadline) == -1) {
+				if (LOAD_ACQUIRE(&self->spi_errno)) {
+					failed = 1;
+				}
+				continue;
+			}
+			total = bulk_packet(self, job, fmt, pkt, id, deadline, &failed);
+		}
+		if (failed) {
+			job->error = BULK_SPI;
+			return;
+		}
+		if (total == 0) {
+			job->error = BULK_TIMEOUT;
+			return;
+		}
+		// the payload is what the length field counts
+		start = 0;
+		plen = total;
+		if (fmt->length == 0) {
+			start = fmt->length_offset + fmt->length_size;
+			plen = getfield(pkt + fmt->length_offset, fmt->length_size, fmt->bigendian);
+			if (start + plen > total) {
+				plen = (start < total) ? total - start : 0;
+			}
+		}
+		if (bulk_output(job, pkt + start, plen) == -1) {
+			return;
+		}
+	}
+	if (job->final_len && bulk_send(self, job->final, job->final_len, now_ns() + job->timeout_ns) == -1) {
+		job->error = LOAD_ACQUIRE(&self->spi_errno) ? BULK_SPI : BULK_WRITE;
+	}
+}
+
+PyDoc_STRVAR(MAX3100_bulk_transfer_doc,
+	"bulk_transfer(out, count, ack, id_offset=4, id_size=2, first_id=0, command=None,\n"
+	"              final=None, reply_id_offset=0, reply_id_delta=1, retries=3,\n"
+	"              timeout=1.0) -> number of bytes stored\n\n"
+	"Download count packages in the set_packet_format() layout, the whole\n"
+	"exchange running in the driver without the GIL. command, if given, is\n"
+	"sent first. Then for each package the ack template is sent with the\n"
+	"package ID (first_id, first_id + 1, ...) in its id_size byte field at\n"
+	"id_offset, and the packet that comes back is checked; unless\n"
+	"reply_id_offset is -1 its own ID field there must read the ack's ID plus\n"
+	"reply_id_delta. An ack that gets no answer within timeout seconds is sent\n"
+	"again, up to retries times. final, if given, is sent at the end.\n"
+	"Each packet's payload (what its length field counts, or all of a fixed\n"
+	"size packet) goes to out: a writable buffer, filled from the start, or\n"
+	"a file descriptor. For the uCAM, after set_packet_format('ucam'):\n"
+	"  bulk_transfer(image, n, b'\\xaa\\x0e\\x00\\x00\\x00\\x00',\n"
+	"                final=b'\\xaa\\x0e\\x00\\x00\\xf0\\xf0')\n"
+	"Raises TimeoutError if a package never arrives. Other threads must not\n"
+	"read from the device meanwhile.\n");
+
+static PyObject *
+MAX3100_bulk_transfer_locked(MAX3100_Object *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *out, *timeout_obj = NULL;
+	Py_buffer outview = {NULL}, ack = {NULL}, command = {NULL}, final = {NULL};
+	PyObject *command_obj = Py_None, *final_obj = Py_None;
+	Py_ssize_t count;
+	int id_offset = 4, id_size = 2, reply_id_offset = 0, retries = 3;
+	unsigned int first_id = 0, reply_id_delta = 1;
+	int64_t timeout = 1000000000L;
+	MAX3100_Bulk job;
+	uint8_t *pkt = NULL;
+	PyObject *result = NULL;
+	static char *kwlist[] = {"out", "count", "ack", "id_offset", "id_size", "first_id", "command",
+	                         "final", "reply_id_offset", "reply_id_delta", "retries", "timeout", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "Ony*|iiIOOiIiO:bulk_transfer", kwlist,
+			&out, &count, &ack, &id_offset, &id_size, &first_id, &command_obj,
+			&final_obj, &reply_id_offset, &reply_id_delta, &retries, &timeout_obj))
+		return NULL;
+	memset(&job, 0, sizeof(job));
+	job.fd = -1;
+	if (self->packet == NULL) {
+		PyErr_SetString(PyExc_RuntimeError, "No packet format, see set_packet_format().");
+		goto done;
+	}
+	if (!IS_OPEN(self)) {
+		PyErr_SetString(PyExc_RuntimeError, "Device is not open.");
+		goto done;
+	}
+	if (timeout_obj && (parse_timeout(timeout_obj, &timeout) < 0))
+		goto done;
+	if (timeout < 0) {
+		PyErr_SetString(PyExc_ValueError, "timeout must not be None.");
+		goto done;
+	}
+	if (count < 0 || count > UINT32_MAX || retries < 0) {
+		PyErr_SetString(PyExc_ValueError, "count and retries must not be negative.");
+		goto done;
+	}
+	if (id_size != 1 && id_size != 2 && id_size != 4) {
+		PyErr_SetString(PyExc_ValueError, "id_size must be 1, 2 or 4.");
+		goto done;
+	}
+	if (ack.len > MAX_PATTERN || id_offset < 0 || id_offset + id_size > ack.len) {
+		PyErr_Format(PyExc_ValueError, "ack must be at most %d bytes and hold the ID field.", MAX_PATTERN);
+		goto done;
+	}
+	if (command_obj != Py_None && PyObject_GetBuffer(command_obj, &command, PyBUF_SIMPLE) < 0)
+		goto done;
+	if (final_obj != Py_None && PyObject_GetBuffer(final_obj, &final, PyBUF_SIMPLE) < 0)
+		goto done;
+	if (PyLong_Check(out)) {
+		if ((job.fd = PyLong_AsLong(out)) < 0) {
+			if (!PyErr_Occurred())
+				PyErr_SetString(PyExc_ValueError, "out must be a writable buffer or a file descriptor.");
+			goto done;
+		}
+	} else if (PyObject_GetBuffer(out, &outview, PyBUF_WRITABLE) < 0) {
+		goto done;
+	}
+	if ((pkt = PyMem_RawMalloc(self->bufsize)) == NULL) {
+		PyErr_NoMemory();
+		goto done;
+	}
+
+	memcpy(job.ack, ack.buf, ack.len);
+	job.ack_len = ack.len;
+	job.id_offset = id_offset;
+	job.id_size = id_size;
+	job.first_id = first_id;
+	job.reply_id_offset = reply_id_offset;
+	job.reply_id_delta = reply_id_delta;
+	job.count = count;
+	job.retries = retries;
+	job.timeout_ns = timeout;
+	job.command = command.buf;
+	job.command_len = command.buf ? command.len : 0;
+	job.final = final.buf;
+	job.final_len = final.buf ? final.len : 0;
+	job.buf = outview.buf;
+	job.bufsize = outview.buf ? outview.len : 0;
+
+	Py_BEGIN_ALLOW_THREADS
+	bulk_run(self, &job, pkt);
+	Py_END_ALLOW_THREADS
+
+	switch (job.error) {
+		case BULK_OK:
+			result = PyLong_FromSize_t(job.written);
+			break;
+		case BULK_TIMEOUT:
+			PyErr_Format(PyExc_TimeoutError, "No valid reply for package %u.", job.first_id + job.done);
+			break;
+		case BULK_OVERFLOW:
+			PyErr_Format(PyExc_ValueError, "out is full after %u packages.", job.done);
+			break;
+		case BULK_OSERROR:
+			errno = job.err;
+			PyErr_SetFromErrno(PyExc_OSError);
+			break;
+		case BULK_WRITE:
+			PyErr_SetString(PyExc_TimeoutError, wrmsg_timeout);
+			break;
+		default:
+			spi_check(self);
+			break;
+	}
+done:
+	PyMem_RawFree(pkt);
+	PyBuffer_Release(&ack);
+	if (command.obj)
+		PyBuffer_Release(&command);
+	if (final.obj)
+		PyBuffer_Release(&final);
+	if (outview.obj)
+		PyBuffer_Release(&outview);
+	return result;
+}
+
+PyDoc_STRVAR(MAX3100_read_to_fd_doc,
+	"read_to_fd(fd, nbytes, timeout=<self.timeout>) -> number of bytes written\n\n"
+	"Write the next nbytes received characters to file descriptor fd,\n"
+	"straight from the receive buffer. Returns early with fewer once timeout\n"
+	"seconds have passed (None waits forever).\n");
+
+static PyObject *
+MAX3100_read_to_fd_locked(MAX3100_Object *self, PyObject *args, PyObject *kwds)
+{
+	int fd;
+	Py_ssize_t nbytes, done = 0;
+	PyObject *timeout_obj = NULL;
+	int64_t timeout = LOAD_ACQUIRE(&self->timeout_ns), deadline = -1;
+	uint32_t st, count, first;
+	ssize_t n = 0;
+	int err = 0;
+	static char *kwlist[] = {"fd", "nbytes", "timeout", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "in|O:read_to_fd", kwlist, &fd, &nbytes, &timeout_obj))
+		return NULL;
+	if (timeout_obj && parse_timeout(timeout_obj, &timeout) < 0)
+		return NULL;
+	if (timeout >= 0)
+		deadline = now_ns() + timeout;
+
+	while (done < nbytes) {
+		Py_BEGIN_ALLOW_THREADS
+		if (!BACKGROUND_RX(self)) {
+			pthread_mutex_lock(&self->lock);
+			fetchbytes(self);
+			pthread_mutex_unlock(&self->lock);
+		}
+		// hand the kernel the ring's own memory, a contiguous piece at a time
+		while (done < nbytes && (count = ringcount(self)) > 0) {
+			st = LOAD_ACQUIRE(&self->bufst);
+			first = self->bufsize - (st & self->bufmask);
+			if (first > count) {
+				first = count;
+			}
+			if (first > nbytes - done) {
+				first = nbytes - done;
+			}
+			if ((n = write(fd, self->buffer + (st & self->bufmask), first)) == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				err = errno;
+				break;
+			}
+			ringskip(self, n);
+			done += n;
+		}
+		if (!err && done < nbytes) {
+			waitrx(self, deadline);
+		}
+		Py_END_ALLOW_THREADS
+		if (err) {
+			errno = err;
+			return PyErr_SetFromErrno(PyExc_OSError);
+		}
+		if (spi_check(self) == -1 || PyErr_CheckSignals())
+			return NULL;
+		if (deadline >= 0 && now_ns() >= deadline)
+			break;
+	}
+	return PyLong_FromSsize_t(done);
+}
+
+PyDoc_STRVAR(MAX3100_capture_doc,
+	"capture(path, size=0, mmap=True) -> None\n\n"
+	"Store the next size received characters in the file at path, replacing\n"
+	"it, from a native thread of its own and without passing them through\n"
+	"Python. Needs the FIFO drained in the background (rx_thread=True or a\n"
+	"MAX3100Group), which file I/O never delays. With mmap the file is\n"
+	"created at its full size and mapped, and the characters copied in;\n"
+	"otherwise they are written to it, and size=0 captures until\n"
+	"capture_stop(). While a capture runs, read() and the other read\n"
+	"methods raise RuntimeError.\n");
+
+static PyObject *
+MAX3100_capture(MAX3100_Object *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *path_obj;
+	unsigned long long size = 0;
+	int use_mmap = 1;
+	MAX3100_Capture *cap;
+	void *map;
+	static char *kwlist[] = {"path", "size", "mmap", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|Kp:capture", kwlist,
+			PyUnicode_FSConverter, &path_obj, &size, &use_mmap))
+		return NULL;
+	if (!BACKGROUND_RX(self)) {
+		Py_DECREF(path_obj);
+		PyErr_SetString(PyExc_RuntimeError, "capture() needs rx_thread=True or a running MAX3100Group.");
+		return NULL;
+	}
+	if (use_mmap && size == 0) {
+		Py_DECREF(path_obj);
+		PyErr_SetString(PyExc_ValueError, "An mmap capture needs a size.");
+		return NULL;
+	}
+	if ((cap = PyMem_RawCalloc(1, sizeof(MAX3100_Capture))) == NULL) {
+		Py_DECREF(path_obj);
+		return PyErr_NoMemory();
+	}
+	cap->size = size;
+	cap->fd = open(PyBytes_AS_STRING(path_obj), (use_mmap ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (cap->fd == -1) {
+		PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path_obj);
+		goto fail;
+	}
+	if (use_mmap) {
+		if (ftruncate(cap->fd, size) == -1) {
+			PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path_obj);
+			goto fail;
+		}
+		if ((map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, cap->fd, 0)) == MAP_FAILED) {
+			PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path_obj);
+			goto fail;
+		}
+		cap->map = map;
+	}
+	cap->active = 1;
+	// take over from any read in progress
+	ACQUIRE_CTLLOCK(self);
+	ACQUIRE_RXLOCK(self);
+	if (self->capture == NULL) {
+		self->capture = cap;
+		if ((errno = pthread_create(&cap->thread, NULL, capturethread, self)) == 0) {
+			cap = NULL;
+		} else {
+			self->capture = NULL;
+			PyErr_SetFromErrno(PyExc_OSError);
+		}
+	} else {
+		PyErr_SetString(PyExc_RuntimeError, "A capture is already in progress.");
+	}
+	RELEASE_RXLOCK(self);
+	RELEASE_CTLLOCK(self);
+	if (cap == NULL) {
+		Py_DECREF(path_obj);
+		Py_RETURN_NONE;
+	}
+
+fail:
+	if (cap->map)
+		munmap(cap->map, cap->size);
+	if (cap->fd != -1)
+		close(cap->fd);
+	PyMem_RawFree(cap);
+	Py_DECREF(path_obj);
+	return NULL;
+}
+
+PyDoc_STRVAR(MAX3100_capture_wait_doc,
+	"capture_wait(timeout=None) -> bool\n\n"
+	"Wait for the capture to reach its size (or fail). Returns False if\n"
+	"timeout seconds pass first. Follow it with capture_stop().\n");
+
+static PyObject *
+MAX3100_capture_wait(MAX3100_Object *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *timeout_obj = Py_None;
+	int64_t timeout, deadline = -1, now;
+	int active;
+	static char *kwlist[] = {"timeout", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:capture_wait", kwlist, &timeout_obj))
+		return NULL;
+	if (parse_timeout(timeout_obj, &timeout) < 0)
+		return NULL;
+	if (timeout >= 0)
+		deadline = now_ns() + timeout;
+	while (1) {
+		// capture_stop() may free it from another thread in the meantime
+		ACQUIRE_CTLLOCK(self);
+		active = self->capture ? LOAD_ACQUIRE(&self->capture->active) : -1;
+		RELEASE_CTLLOCK(self);
+		if (active == -1) {
+			PyErr_SetString(PyExc_RuntimeError, "No capture in progress.");
+			return NULL;
+		}
+		if (!active)
+			break;
+		now = now_ns();
+		if (deadline >= 0 && now >= deadline)
+			Py_RETURN_FALSE;
+		Py_BEGIN_ALLOW_THREADS
+		sleep_ns((deadline >= 0 && deadline - now < self->chartime_ns*MAX3100_FIFO) ?
+		         deadline - now : self->chartime_ns*MAX3100_FIFO);
+		Py_END_ALLOW_THREADS
+		if (PyErr_CheckSignals())
+			return NULL;
+	}
+	Py_RETURN_TRUE;
+}
+
+PyDoc_STRVAR(MAX3100_capture_stop_doc,
+	"capture_stop() -> number of bytes captured\n\n"
+	"End the capture and close its file, cut short to what was captured.\n"
+	"Raises OSError if writing it failed.\n");
+
+static PyObject *
+MAX3100_capture_stop(MAX3100_Object *self)
+{
+	uint64_t done;
+	int err;
+	ACQUIRE_CTLLOCK(self);
+	if (self->capture == NULL) {
+		RELEASE_CTLLOCK(self);
+		PyErr_SetString(PyExc_RuntimeError, "No capture in progress.");
+		return NULL;
+	}
+	err = capture_finish(self, &done);
+	RELEASE_CTLLOCK(self);
+	if (err) {
+		errno = err;
+		return PyErr_SetFromErrno(PyExc_OSError);
+	}
+	return PyLong_FromUnsignedLongLong(done);
+}
+
+static PyObject *
+MAX3100_get_captured(MAX3100_Object *self, void *closure)
+{
+	uint64_t done;
+	ACQUIRE_CTLLOCK(self);
+	done = self->capture ? LOAD_ACQUIRE(&self->capture->done) : 0;
+	RELEASE_CTLLOCK(self);
+	return PyLong_FromUnsignedLongLong(done);
+}
+
+PyDoc_STRVAR(MAX3100_available_doc,
+	"available() -> number of characters currently available to read\n");
+
+static PyObject *
+MAX3100_available(MAX3100_Object *self)
+{
+	int n;
+	if (BACKGROUND_RX(self)) {
+		if (spi_check(self) == -1)
+			return NULL;
+		return Py_BuildValue("i", ringcount(self));
+	}
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&self->lock);
+	n = available(self);
+	pthread_mutex_unlock(&self->lock);
+	Py_END_ALLOW_THREADS
+	if (spi_check(self) == -1)
+		return NULL;
+	return Py_BuildValue("i", n);
+}
+
+static PyObject *
+MAX3100_inwaiting(MAX3100_Object *self, void *closure)
+{
+	return MAX3100_available(self);
+}
+
+PyDoc_STRVAR(MAX3100_reset_stats_doc,
+	"reset_stats()\n\n"
+	"Zero the counters reported by the stats attribute.\n");
+
+static PyObject *
+MAX3100_reset_stats(MAX3100_Object *self)
+{
+	ACQUIRE_LOCK(self);
+	memset(&self->stats, 0, sizeof(self->stats));
+	RELEASE_LOCK(self);
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(MAX3100_sim_inject_doc,
+	"sim_inject(data) -> None\n\n"
+	"Queue data on the receive line of the simulated MAX3100. Characters\n"
+	"reach its FIFO one character time apart (or at sim_rate), after any\n"
+	"already queued; those arriving to a full FIFO are lost.\n");
+
+static PyObject *
+MAX3100_sim_inject(MAX3100_Object *self, PyObject *args)
+{
+	Py_buffer view;
+	const uint8_t *data;
+	MAX3100_Sim *sim;
+	int64_t t, gap;
+	int rc = 0;
+
+	if (!PyArg_ParseTuple(args, "y*:sim_inject", &view))
+		return NULL;
+	data = view.buf;
+	ACQUIRE_LOCK(self);
+	if ((sim = self->sim) == NULL) {
+		RELEASE_LOCK(self);
+		PyBuffer_Release(&view);
+		PyErr_SetString(PyExc_RuntimeError, "Not connected to the simulated transport.");
+		return NULL;
+	}
+	gap = (sim->interval_ns > self->chartime_ns) ? sim->interval_ns : self->chartime_ns;
+	t = now_ns();
+	if (sim->lineend > sim->linest && sim->line[sim->lineend-1].t > t) {
+		// queue up behind characters still on their way
+		t = sim->line[sim->lineend-1].t;
+	}
+	for (Py_ssize_t ii = 0; ii < view.len && rc == 0; ii++) {
+		t += gap;
+		rc = sim_linechar(sim, t, data[ii] | paritybit(self, data[ii]));
+	}
+	RELEASE_LOCK(self);
+	PyBuffer_Release(&view);
+	if (rc == -1)
+		return PyErr_NoMemory();
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(MAX3100_trace_start_doc,
+	"trace_start(size=65536) -> None\n\n"
+	"Start recording every SPI word sent and received, with timestamps, in\n"
+	"a ring of the last size words (rounded up to a power of two, at least\n"
+	"128). Any previous trace is discarded.\n");
+
+static PyObject *
+MAX3100_trace_start(MAX3100_Object *self, PyObject *args, PyObject *kwds)
+{
+	Py_ssize_t size = TRACE_SIZE;
+	uint32_t n;
+	MAX3100_TraceRec *trace, *old;
+	static char *kwlist[] = {"size", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|n:trace_start", kwlist, &size))
+		return NULL;
+	if (size < 1 || size > MAX_TRACE_SIZE) {
+		PyErr_Format(PyExc_ValueError, "size must be between 1 and %u.", MAX_TRACE_SIZE);
+		return NULL;
+	}
+	for (n = 2*MAX3100_MAXBATCH; n < size; n <<= 1)
+		;
+	if ((trace = PyMem_RawCalloc(n, sizeof(MAX3100_TraceRec))) == NULL)
+		return PyErr_NoMemory();
+	// ctllock keeps a trace_snapshot() off the ring we free
+	ACQUIRE_CTLLOCK(self);
+	ACQUIRE_LOCK(self);
+	old = self->trace;
+	self->trace = trace;
+	self->tracemask = n - 1;
+	STORE_RELEASE(&self->tracehead, 0);
+	self->tracing = 1;
+	RELEASE_LOCK(self);
+	PyMem_RawFree(old);
+	RELEASE_CTLLOCK(self);
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(MAX3100_trace_stop_doc,
+	"trace_stop() -> None\n\n"
+	"Stop recording SPI words; the trace so far can still be dumped.\n");
+
+static PyObject *
+MAX3100_trace_stop(MAX3100_Object *self)
+{
+	ACQUIRE_LOCK(self);
+	self->tracing = 0;
+	RELEASE_LOCK(self);
+	Py_RETURN_NONE;
+}
+
+/* Copy out the trace, oldest record first, into PyMem_RawMalloc'd memory.
+   Runs without the object lock, so records the writer may have reused
+   while we copied are dropped from the front. ctllock held, which keeps
+   trace_start() from freeing the ring underneath us. */
+static MAX3100_TraceRec *
+trace_snapshot_locked(MAX3100_Object *self, size_t *count)
+{
+	uint64_t head, after, first;
+	uint64_t size = (uint64_t)self->tracemask + 1;
+	MAX3100_TraceRec *recs;
+	size_t n;
+
+	*count = 0;
+	if (self->trace == NULL) {
+		return PyMem_RawMalloc(1);
+	}
+	head = LOAD_ACQUIRE(&self->tracehead);
+	first = (head > size) ? head - size : 0;
+	if ((recs = PyMem_RawMalloc((head - first)*sizeof(MAX3100_TraceRec) + 1)) == NULL) {
+		return NULL;
+	}
+	for (uint64_t i = first; i < head; i++) {
+		recs[i - first] = self->trace[i & self->tracemask];
+	}
+	after = LOAD_ACQUIRE(&self->tracehead);
+	if (LOAD_ACQUIRE(&self->tracing)) {
+		// the writer may also be part way through its next message
+		after += MAX3100_MAXBATCH;
+	}
+	n = head - first;
+	if (after > first + size) {
+		// records before after - size may have been overwritten
+		size_t stale = (after - size - first < n) ? after - size - first : n;
+		memmove(recs, recs + stale, (n - stale)*sizeof(MAX3100_TraceRec));
+		n -= stale;
+	}
+	*count = n;
+	return recs;
+}
+
+static MAX3100_TraceRec *
+trace_snapshot(MAX3100_Object *self, size_t *count)
+{
+	MAX3100_TraceRec *recs;
+	ACQUIRE_CTLLOCK(self);
+	recs = trace_snapshot_locked(self, count);
+	RELEASE_CTLLOCK(self);
+	return recs;
+}
+
+PyDoc_STRVAR(MAX3100_trace_dump_doc,
+	"trace_dump() -> bytes\n\n"
+	"Return the recorded SPI words, oldest first, as packed records of\n"
+	"max3100.TRACE_FORMAT: start time of the SPI message in ns\n"
+	"(CLOCK_MONOTONIC), its duration in ns, word sent, word received.\n");
+
+static PyObject *
+MAX3100_trace_dump(MAX3100_Object *self)
+{
+	size_t n;
+	PyObject *result;
+	MAX3100_TraceRec *recs = trace_snapshot(self, &n);
+
+	if (recs == NULL)
+		return PyErr_NoMemory();
+	result = PyBytes_FromStringAndSize((const char *)recs, n*sizeof(MAX3100_TraceRec));
+	PyMem_RawFree(recs);
+	return result;
+}
+
+static const char *cmdname[4] = {"READ_DATA", "READ_CONF", "WRITE_DATA", "WRITE_CONF"};
+
+// Chrome trace event JSON: a slice per SPI message, instants per character.
+static int
+trace_write_json(FILE *f, const MAX3100_TraceRec *recs, size_t n)
+{
+	size_t i, j, k;
+	fputs("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n", f);
+	fputs("{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"spi\"}},\n", f);
+	fputs("{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, \"args\": {\"name\": \"rx\"}},\n", f);
+	fputs("{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 3, \"args\": {\"name\": \"tx\"}}", f);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && recs[j].t_ns == recs[i].t_ns && recs[j].dur_ns == recs[i].dur_ns; j++)
+			;
+		fprintf(f, ",\n{\"name\": \"%s x%zu\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, "
+		        "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"tx\": [",
+		        cmdname[recs[i].tx >> 14], j - i, recs[i].t_ns/1e3, recs[i].dur_ns/1e3);
+		for (k = i; k < j; k++)
+			fprintf(f, "%s\"0x%04x\"", k > i ? ", " : "", recs[k].tx);
+		fputs("], \"rx\": [", f);
+		for (k = i; k < j; k++)
+			fprintf(f, "%s\"0x%04x\"", k > i ? ", " : "", recs[k].rx);
+		fputs("]}}", f);
+		for (k = i; k < j; k++) {
+			int data = (recs[k].tx & 0x4000) == 0;	// READ_DATA/WRITE_DATA carry characters
+			if (data && (recs[k].rx & MAX3100_CONF_R))
+				fprintf(f, ",\n{\"name\": \"rx 0x%02x\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": 2, "
+				        "\"ts\": %.3f}", recs[k].rx & 0xff, (recs[k].t_ns + recs[k].dur_ns)/1e3);
+			if ((recs[k].tx & 0xc000) == MAX3100_CMD_WRITE_DATA && !(recs[k].tx & MAX3100_DATA_TE))
+				fprintf(f, ",\n{\"name\": \"tx 0x%02x\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": 3, "
+				        "\"ts\": %.3f}", recs[k].tx & 0xff, recs[k].t_ns/1e3);
+		}
+	}
+	fputs("\n]}\n", f);
+	return ferror(f) ? -1 : 0;
+}
+
+PyDoc_STRVAR(MAX3100_trace_export_doc,
+	"trace_export(path) -> None\n\n"
+	"Write the recorded SPI words to path as Chrome trace event JSON, which\n"
+	"Perfetto and chrome://tracing load: one slice per SPI message plus an\n"
+	"instant for every character received or transmitted.\n");
+
+static PyObject *
+MAX3100_trace_export(MAX3100_Object *self, PyObject *args)
+{
+	PyObject *pathobj;
+	const char *path;
+	size_t n;
+	MAX3100_TraceRec *recs;
+	FILE *f;
+	int rc;
+
+	if (!PyArg_ParseTuple(args, "O&:trace_export", PyUnicode_FSConverter, &pathobj))
+		return NULL;
+	path = PyBytes_AS_STRING(pathobj);
+	if ((recs = trace_snapshot(self, &n)) == NULL) {
+		Py_DECREF(pathobj);
+		return PyErr_NoMemory();
+	}
+	Py_BEGIN_ALLOW_THREADS
+	if ((f = fopen(path, "w")) != NULL) {
+		rc = trace_write_json(f, recs, n);
+		if (fclose(f) != 0)
+			rc = -1;
+	} else {
+		rc = -1;
+	}
+	Py_END_ALLOW_THREADS
+	PyMem_RawFree(recs);
+	if (rc == -1) {
+		PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+		Py_DECREF(pathobj);
+		return NULL;
+	}
+	Py_DECREF(pathobj);
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(MAX3100_fileno_doc,
+	"fileno() -> file descriptor\n\n"
+	"Return an eventfd that becomes readable whenever received characters\n"
+	"are stored in the receive buffer, for use with select/poll or an event\n"
+	"loop's add_reader(). Read it to reset it before checking in_waiting.\n"
+	"It is not the device: reading or writing it moves no serial data, and\n"
+	"os.read() on it returns an 8 byte counter.\n"
+	"Only the background receive thread (rx_thread=True) stores characters\n"
+	"without being asked, otherwise it fires only during read()/write().\n");
+
+static PyObject *
+MAX3100_fileno(MAX3100_Object *self)
+{
+	int fd;
+	ACQUIRE_LOCK(self);
+	if (self->efd == -1) {
+		self->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	}
+	fd = self->efd;
+	RELEASE_LOCK(self);
+	if (fd == -1) {
+		PyErr_SetFromErrno(PyExc_OSError);
+		return NULL;
+	}
+	return PyLong_FromLong(fd);
+}
+
+PyDoc_STRVAR(MAX3100_clear_doc,
+	"clear() -> flush all yet to be read characters\n");
+
+static PyObject *
+MAX3100_clear(MAX3100_Object *self)
+{
+	ACQUIRE_RXLOCK(self);
+	if (LOAD_ACQUIRE(&self->capture) != NULL) {
+		RELEASE_RXLOCK(self);
+		PyErr_SetString(PyExc_RuntimeError, busymsg_capture);
+		return NULL;
+	}
+	if (BACKGROUND_RX(self)) {
+		STORE_RELEASE(&self->bufst, LOAD_ACQUIRE(&self->bufend));
+		RELEASE_RXLOCK(self);
+		Py_RETURN_NONE;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	pthread_mutex_lock(&self->lock);
+	clear(self);
+	pthread_mutex_unlock(&self->lock);
+	Py_END_ALLOW_THREADS
+	RELEASE_RXLOCK(self);
+	if (spi_check(self) == -1)
+		return NULL;
+	Py_INCREF(Py_None);
+	return Py_None;
+}
+
+
+// Baud rate divisors for each crystal, zero terminated.
+typedef struct {
+	int baud;
+	uint16_t conf;
+} MAX3100_BaudConf;
+
+static const MAX3100_BaudConf baud_x1[] = {
+	{115200, MAX3100_CONF_BAUD_X1_115200},
+	{57600, MAX3100_CONF_BAUD_X1_57600},
+	{38400, MAX3100_CONF_BAUD_X1_38400},
+	{19200, MAX3100_CONF_BAUD_X1_19200},
+	{9600, MAX3100_CONF_BAUD_X1_9600},
+	{4800, MAX3100_CONF_BAUD_X1_4800},
+	{2400, MAX3100_CONF_BAUD_X1_2400},
+	{1200, MAX3100_CONF_BAUD_X1_1200},
+	{600, MAX3100_CONF_BAUD_X1_600},
+	{300, MAX3100_CONF_BAUD_X1_300},
+	{0, 0},
+};
+
+static const MAX3100_BaudConf baud_x2[] = {
+	{230400, MAX3100_CONF_BAUD_X2_230400},
+	{115200, MAX3100_CONF_BAUD_X2_115200},
+	{57600, MAX3100_CONF_BAUD_X2_57600},
+	{38400, MAX3100_CONF_BAUD_X2_38400},
+	{19200, MAX3100_CONF_BAUD_X2_19200},
+	{9600, MAX3100_CONF_BAUD_X2_9600},
+	{4800, MAX3100_CONF_BAUD_X2_4800},
+	{2400, MAX3100_CONF_BAUD_X2_2400},
+	{1200, MAX3100_CONF_BAUD_X2_1200},
+	{600, MAX3100_CONF_BAUD_X2_600},
+	{0, 0},
+};
+
+static int
+parse_parity(const char *str, uint8_t *parity)
+{
+	if (strcmp(str, "N") == 0) {
+		*parity = PARITY_NONE;
+	} else if (strcmp(str, "E") == 0) {
+		*parity = PARITY_EVEN;
+	} else if (strcmp(str, "O") == 0) {
+		*parity = PARITY_ODD;
+	} else {
+		PyErr_SetString(PyExc_ValueError, "parity must be 'N', 'E' or 'O'.");
+		return -1;
+	}
+	return 0;
+}
+
+/* Configuration register bits (without the command or interrupt masks)
+   for the given settings, -1 with ValueError set if the MAX3100 can't
+   do them. */
+static int
+makeconf(int crystal, int baud, int bytesize, uint8_t parity, int stopbits, int fifo, int irda)
+{
+	const MAX3100_BaudConf *bc;
+	int conf;
+
+	if (crystal == MAX3100_CRYSTAL_1843kHz) {
+		bc = baud_x1;
+	} else if (crystal == MAX3100_CRYSTAL_3686kHz) {
+		bc = baud_x2;
+	} else {
+		PyErr_SetString(PyExc_ValueError, "crystal must be 1 (1.8432MHz) or 2 (3.6864MHz).");
+		return -1;
+	}
+	for (; bc->baud && bc->baud != baud; bc++)
+		;
+	if (bc->baud == 0) {
+		PyErr_Format(PyExc_ValueError, "baud %d is not supported with crystal %d.", baud, crystal);
+		return -1;
+	}
+	if (bytesize != 7 && bytesize != 8) {
+		PyErr_SetString(PyExc_ValueError, "bytesize must be 7 or 8.");
+		return -1;
+	}
+	if (stopbits != 1 && stopbits != 2) {
+		PyErr_SetString(PyExc_ValueError, "stopbits must be 1 or 2.");
+		return -1;
+	}
+	conf = bc->conf;
+	if (!fifo)
+		conf |= MAX3100_CONF_FEN;
+	if (irda)
+		conf |= MAX3100_CONF_IR;
+	if (stopbits == 2)
+		conf |= MAX3100_CONF_ST;
+	if (parity != PARITY_NONE)
+		conf |= MAX3100_CONF_PE;
+	if (bytesize == 7)
+		conf |= MAX3100_CONF_L;
+	return conf;
+}
+
+// Write the configuration register and take on its timing, lock held.
+static void writeconf(MAX3100_Object *self, uint16_t conf, int baud, uint8_t parity) {
+	transfer16(self, MAX3100_CMD_WRITE_CONF | conf);
+	self->conf = conf;
+	self->parity = parity;
+	self->baud = baud;
+	self->chartime_ns = framebits(conf)*1000000000L/baud;
+	// gaps seen at the old rate say nothing about the new one
+	self->rx_gap_ns = 0;
+	self->last_empty_ns = 0;
+}
+
+/* Apply new line settings, -1 (and a Python exception) for anything the
+   MAX3100 can't do and as is for the rest. Called with the GIL. */
+static int
+reconfigure(MAX3100_Object *self, int baud, int crystal, int bytesize, const char *paritystr,
+            int stopbits, int fifo, int irda)
+{
+	uint8_t parity, newparity = 0;
+	uint16_t cur;
+	int conf;
+	int64_t now;
+	uint32_t end;
+
+	if (paritystr != NULL && parse_parity(paritystr, &newparity) == -1)
+		return -1;
+	// The current settings are read under the lock too, so a concurrent
+	// configure() can't be undone by one that started before it.
+	ACQUIRE_LOCK(self);
+	if (!IS_OPEN(self)) {
+		RELEASE_LOCK(self);
+		PyErr_SetString(PyExc_RuntimeError, "Device is not open.");
+		return -1;
+	}
+	cur = self->conf;
+	parity = (paritystr != NULL) ? newparity : self->parity;
+	if (baud == -1)
+		baud = self->baud;
+	if (crystal == -1)
+		crystal = self->crystal;
+	if (bytesize == -1)
+		bytesize = (cur & MAX3100_CONF_L) ? 7 : 8;
+	if (stopbits == -1)
+		stopbits = (cur & MAX3100_CONF_ST) ? 2 : 1;
+	if (fifo == -1)
+		fifo = !(cur & MAX3100_CONF_FEN);
+	if (irda == -1)
+		irda = (cur & MAX3100_CONF_IR) != 0;
+	if ((conf = makeconf(crystal, baud, bytesize, parity, stopbits, fifo, irda)) == -1) {
+		RELEASE_LOCK(self);
+		return -1;
+	}
+	conf |= cur & MAX3100_CONF_IRQMASK;
+
+	// Nothing received at the old settings may be lost, nor the
+	// character being sent garbled.
+	Py_BEGIN_ALLOW_THREADS
+	end = self->bufend;
+	fetchbytes(self);
+	now = now_ns();
+	if (self->tx_shift_end > now) {
+		sleep_ns(self->tx_shift_end - now);
+	}
+	writeconf(self, conf, baud, parity);
+	self->crystal = crystal;
+	ringnotify(self, end);
+	pthread_mutex_unlock(&self->lock);
+	Py_END_ALLOW_THREADS
+	return spi_check(self);
+}
+
+PyDoc_STRVAR(MAX3100_configure_doc,
+	"configure(baud=None, crystal=None, bytesize=None, parity=None, stopbits=None,\n"
+	"          fifo=None, irda=None) -> None\n\n"
+	"Change the line settings of an open MAX3100 without reopening it;\n"
+	"settings left as None keep their current value. Characters already in\n"
+	"the MAX3100 FIFO are moved to the receive buffer and any character\n"
+	"being transmitted is allowed to finish first; the receive buffer is\n"
+	"kept. Raises ValueError for combinations the MAX3100 can't do.\n");
+
+static PyObject *
+MAX3100_configure(MAX3100_Object *self, PyObject *args, PyObject *kwds)
+{
+	int baud = -1, crystal = -1, bytesize = -1, stopbits = -1, fifo = -1, irda = -1;
+	const char *paritystr = NULL;
+	static char *kwlist[] = {"baud", "crystal", "bytesize", "parity", "stopbits", "fifo", "irda", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiiziii:configure", kwlist,
+			&baud, &crystal, &bytesize, &paritystr, &stopbits, &fifo, &irda))
+		return NULL;
+	if (reconfigure(self, baud, crystal, bytesize, paritystr, stopbits, fifo, irda) == -1)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(MAX3100_set_baud_doc,
+	"set_baud(baud) -> None\n\n"
+	"Switch to another baud rate, as configure(baud=baud).\n");
+
+static PyObject *
+MAX3100_set_baud(MAX3100_Object *self, PyObject *args)
+{
+	int baud;
+
+	if (!PyArg_ParseTuple(args, "i:set_baud", &baud))
+		return NULL;
+	if (reconfigure(self, baud, -1, -1, NULL, -1, -1, -1) == -1)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(MAX3100_reset_input_buffer_doc,
+	"reset_input_buffer() -> None\n\n"
+	"Discard received characters not yet read, as clear().\n");
+
+PyDoc_STRVAR(MAX3100_reset_output_buffer_doc,
+	"reset_output_buffer() -> None\n\n"
+	"Discard characters queued for transmission but not yet sent.\n");
+
+static PyObject *
+MAX3100_reset_output_buffer(MAX3100_Object *self)
+{
+	ACQUIRE_LOCK(self);
+	STORE_RELEASE(&self->txst, LOAD_ACQUIRE(&self->txend));
+	RELEASE_LOCK(self);
+	Py_RETURN_NONE;
+}
+
+// io.RawIOBase: a serial line reads and writes but doesn't seek.
+static PyObject *
+MAX3100_true(MAX3100_Object *self)
+{
+	Py_RETURN_TRUE;
+}
+
+static PyObject *
+MAX3100_false(MAX3100_Object *self)
+{
+	Py_RETURN_FALSE;
+}
+
+PyDoc_STRVAR(MAX3100_open_doc,
+	"open(bus=0, device=0, crystal=2, baud=9600, spispeed=7800000, maxmisses=10, batch=8, rx_thread=False,\n"
+	"     irq_chip=0, irq_line=-1, bufsize=8192, overflow='drop_newest', poll='misses',\n"
+	"     transport='spidev', sim_fifo=8, sim_rate=0, sim_loopback=False,\n"
+	"     bytesize=8, parity='N', stopbits=1, fifo=True, irda=False, rtscts=False,\n"
+	"     txbufsize=0, rt_priority=0, cpu=None, mlock=False)\n\n"
+	"Connects the object to the specified SPI device.\n"
+	"open(X,Y,...) will open /dev/spidev<X>.<Y>\n"
+	"batch is the number of READ_DATA words clocked per SPI ioctl (1-64)\n"
+	"when draining the receive FIFO.\n"
+	"rx_thread=True starts a native thread that keeps the FIFO drained\n"
+	"into the receive buffer; read() then only consumes that buffer.\n"
+	"irq_line >= 0 names the line of /dev/gpiochip<irq_chip> wired to the\n"
+	"MAX3100 IRQ pin; receive then waits for the IRQ instead of polling.\n"
+	"bufsize is the receive buffer capacity, rounded up to a power of two.\n"
+	"overflow says what happens when it is full: 'drop_newest' discards new\n"
+	"characters, 'drop_oldest' discards the oldest buffered ones, 'block'\n"
+	"stops draining the MAX3100 FIFO until there is room.\n"
+	"poll='misses' stops draining after maxmisses empty words; 'adaptive'\n"
+	"stops once no character has arrived for about two character times at\n"
+	"baud (or two recent inter-character gaps), ignoring maxmisses.\n"
+	"'predictive' clocks one word for each character time since the FIFO\n"
+	"was last found empty, up to the FIFO depth, and no more.\n"
+	"transport='sim' talks to an in-process simulated MAX3100 instead of\n"
+	"/dev/spidev<X>.<Y>: its receive FIFO holds sim_fifo characters,\n"
+	"sim_inject() characters arrive at the line rate or sim_rate characters\n"
+	"per second if slower, and with sim_loopback transmitted characters are\n"
+	"received again. SPI transfers take no time.\n"
+	"bytesize (7 or 8), parity ('N', 'E' or 'O', generated and checked in\n"
+	"software through the MAX3100's ninth bit) and stopbits (1 or 2) set the\n"
+	"framing; fifo=False disables the receive FIFO and irda=True selects\n"
+	"IrDA timing. rtscts=True deasserts RTS while the receive buffer is\n"
+	"over three quarters full and holds transmission while CTS is\n"
+	"deasserted.\n"
+	"txbufsize > 0 gives write() a transmit queue of that many characters\n"
+	"(rounded up to a power of two), drained by the background thread.\n"
+	"rt_priority (1-99) runs the rx_thread under SCHED_FIFO at that\n"
+	"priority, which needs CAP_SYS_NICE or an RLIMIT_RTPRIO allowance;\n"
+	"cpu (a CPU number or a sequence of them) pins it to those CPUs.\n"
+	"mlock=True locks all of the process's memory, current and future,\n"
+	"so page faults cannot delay the thread.\n"
+	"A failed SPI transfer raises IOError from the call that made it, or\n"
+	"for the background thread, from the next call that reads or writes.\n");
+
+static PyObject *
+MAX3100_open_locked(MAX3100_Object *self, PyObject *args, PyObject *kwds)
+{
+	int bus=0;
+	int device=0;
+	int crystal=2;
+	int baud=9600;
+	int spispeed = 7800000;
+	int maxmisses = 10;
+	int batch = MAX3100_FIFO;
+	int rx_thread = 0;
+	int irq_chip = 0;
+	int irq_line = -1;
+	Py_ssize_t bufsize = BUFSIZE;
+	const char *overflow = "drop_newest";
+	const char *pollstr = "misses";
+	uint8_t policy, pollmode;
+	uint32_t size;
+	uint8_t *buffer = NULL;
+	const char *transport = "spidev";
+	int sim_fifo = MAX3100_FIFO;
+	int sim_rate = 0;
+	int sim_loopback = 0;
+	int bytesize = 8;
+	const char *paritystr = "N";
+	int stopbits = 1;
+	int fifo = 1;
+	int irda = 0;
+	int rtscts = 0;
+	Py_ssize_t txbufsize = 0;
+	int rt_priority = 0;
+	PyObject *cpu = Py_None;
+	int mlock = 0;
+	MAX3100_Sched sched;
+	uint32_t txsize = 0;
+	uint8_t *txbuf = NULL;
+	uint8_t parity;
+	int conf;
+	int sim;
+	char path[SPIDEV_MAXPATH];
+	static char *kwlist[] = {"bus", "device", "crystal", "baud", "spispeed", "maxmisses", "batch", "rx_thread",
+	                         "irq_chip", "irq_line", "bufsize", "overflow", "poll",
+	                         "transport", "sim_fifo", "sim_rate", "sim_loopback",
+	                         "bytesize", "parity", "stopbits", "fifo", "irda", "rtscts", "txbufsize",
+	                         "rt_priority", "cpu", "mlock", NULL};
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiiiiiipiinsssiipisipppniOp:open", kwlist, 
+	                                 &bus, &device, &crystal, &baud, &spispeed, &maxmisses, &batch, &rx_thread,
+	                                 &irq_chip, &irq_line, &bufsize, &overflow, &pollstr,
+	                                 &transport, &sim_fifo, &sim_rate, &sim_loopback,
+	                                 &bytesize, &paritystr, &stopbits, &fifo, &irda, &rtscts, &txbufsize,
+	                                 &rt_priority, &cpu, &mlock))
+		return NULL;
+	if (parse_sched(rt_priority, cpu, &sched) == -1)
+		return NULL;
+	if (txbufsize < 0 || txbufsize > MAX_BUFSIZE) {
+		PyErr_Format(PyExc_ValueError, "txbufsize must be between 0 and %u.", MAX_BUFSIZE);
+		return NULL;
+	}
+	if (txbufsize > 0) {
+		for (txsize = 16; txsize < txbufsize; txsize <<= 1)
+			;
+	}
+	if (parse_parity(paritystr, &parity) == -1)
+		return NULL;
+	// IRQ only for received data: with TM too it would stay asserted
+	// whenever the transmitter is idle, and irq_line waits return at once.
+	if ((conf = makeconf(crystal, baud, bytesize, parity, stopbits, fifo, irda)) == -1)
+		return NULL;
+	conf |= MAX3100_CONF_RM;
+	if (strcmp(transport, "spidev") == 0) {
+		sim = 0;
+	} else if (strcmp(transport, "sim") == 0) {
+		sim = 1;
+	} else {
+		PyErr_SetString(PyExc_ValueError, "transport must be 'spidev' or 'sim'.");
+		return NULL;
+	}
+	if (sim && irq_line >= 0) {
+		PyErr_SetString(PyExc_ValueError, "The simulated transport has no IRQ line.");
+		return NULL;
+	}
+	if (sim_fifo < 1 || sim_fifo > SIM_MAXFIFO) {
+		PyErr_Format(PyExc_ValueError, "sim_fifo must be between 1 and %d.", SIM_MAXFIFO);
+		return NULL;
+	}
+	if (sim_rate < 0) {
+		PyErr_SetString(PyExc_ValueError, "sim_rate must not be negative.");
+		return NULL;
+	}
+	if (bufsize < 16 || bufsize > MAX_BUFSIZE) {
+		PyErr_Format(PyExc_ValueError, "bufsize must be between 16 and %u.", MAX_BUFSIZE);
+		return NULL;
+	}
+	for (size = 16; size < bufsize; size <<= 1)
+		;
+	if (strcmp(overflow, "drop_newest") == 0) {
+		policy = OVERFLOW_DROP_NEWEST;
+	} else if (strcmp(overflow, "drop_oldest") == 0) {
+		policy = OVERFLOW_DROP_OLDEST;
+	} else if (strcmp(overflow, "block") == 0) {
+		policy = OVERFLOW_BLOCK;
+	} else {
+		PyErr_SetString(PyExc_ValueError,
+			"overflow must be 'drop_newest', 'drop_oldest' or 'block'.");
+		return NULL;
+	}
+	if (strcmp(pollstr, "misses") == 0) {
+		pollmode = POLL_MISSES;
+	} else if (strcmp(pollstr, "adaptive") == 0) {
+		pollmode = POLL_ADAPTIVE;
+	} else if (strcmp(pollstr, "predictive") == 0) {
+		pollmode = POLL_PREDICTIVE;
+	} else {
+		PyErr_SetString(PyExc_ValueError, "poll must be 'misses', 'adaptive' or 'predictive'.");
+		return NULL;
+	}
+	if (batch < 1 || batch > MAX3100_MAXBATCH) {
+		PyErr_Format(PyExc_ValueError,
+			"batch must be between 1 and %d.", MAX3100_MAXBATCH);
+		return NULL;
+	}
+	if (snprintf(path, SPIDEV_MAXPATH, "/dev/spidev%d.%d", bus, device) >= SPIDEV_MAXPATH) {
+		PyErr_SetString(PyExc_OverflowError,
+			"Bus and/or device number is invalid.");
+		return NULL;
+	}
+	if (mlock && lock_memory() == -1)
+		return NULL;
+  
+	if (size != self->bufsize && (buffer = PyMem_RawMalloc(size)) == NULL) {
+		return PyErr_NoMemory();
+	}
+	if (txsize != self->txsize && txsize && (txbuf = PyMem_RawMalloc(txsize)) == NULL) {
+		PyMem_RawFree(buffer);
+		return PyErr_NoMemory();
+	}
+	if (self->grouped) {
+		PyMem_RawFree(buffer);
+		PyMem_RawFree(txbuf);
+		PyErr_SetString(PyExc_RuntimeError, busymsg_group);
+		return NULL;
+	}
+	if (self->rx_running) {
+		Py_BEGIN_ALLOW_THREADS
+		stop_rxthread(self);
+		Py_END_ALLOW_THREADS
+	}
+
+	// resizing loses whatever was buffered, once no read or write is using it
+	if (buffer) {
+		ACQUIRE_RXLOCK(self);
+	}
+	ACQUIRE_TXLOCK(self);
+	ACQUIRE_LOCK(self);
+	if (buffer) {
+		PyMem_RawFree(self->buffer);
+		self->buffer = buffer;
+		self->bufsize = size;
+		self->bufmask = size - 1;
+		self->bufst = self->bufend = 0;
+		RELEASE_RXLOCK(self);
+	}
+	if (txsize != self->txsize) {
+		PyMem_RawFree(self->txbuf);
+		self->txbuf = txbuf;
+		self->txsize = txsize;
+		self->txmask = txsize ? txsize - 1 : 0;
+	}
+	self->txst = self->txend = 0;
+	RELEASE_TXLOCK(self);
+	self->overflow = policy;
+	self->pollmode = pollmode;
+	// reopening drops the previous connection, and IRQ line
+	self->transport->close(self);
+	if (self->irq_fd != -1) {
+		close(self->irq_fd);
+		self->irq_fd = -1;
+	}
+	self->spi_errno = 0;
+	if ((sim ? sim_open(self, sim_fifo, sim_rate, sim_loopback)
+	         : spidev_open(self, path, spispeed)) == -1) {
+		// the old transport is already closed; don't let close() call it again
+		self->transport = &spidev_transport;
+		RELEASE_LOCK(self);
+		PyErr_SetFromErrno(PyExc_IOError);
+		return NULL;
+	}
+	self->max_speed_hz = spispeed;
+	xfer_setup(self);
+
+	if (irq_line >= 0) {
+		struct gpioevent_request req;
+		int chipfd;
+		snprintf(path, SPIDEV_MAXPATH, "/dev/gpiochip%d", irq_chip);
+		if ((chipfd = open(path, O_RDWR, 0)) == -1) {
+			PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+			goto unwind;
+		}
+		memset(&req, 0, sizeof(req));
+		req.lineoffset = irq_line;
+		req.handleflags = GPIOHANDLE_REQUEST_INPUT | GPIOHANDLE_REQUEST_ACTIVE_LOW;
+		req.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+		strncpy(req.consumer_label, "max3100", sizeof(req.consumer_label) - 1);
+		if (ioctl(chipfd, GPIO_GET_LINEEVENT_IOCTL, &req) == -1) {
+			PyErr_SetFromErrno(PyExc_IOError);
+			close(chipfd);
+			goto unwind;
+		}
+		close(chipfd);
+		fcntl(req.fd, F_SETFL, O_NONBLOCK);
+		self->irq_fd = req.fd;
+	}
+	self->maxmisses = maxmisses;
+	self->batch = batch;
+	self->crystal = crystal;
+
+	writeconf(self, conf, baud, parity);
+	self->rtscts = rtscts;
+	setrts(self, MAX3100_DATA_RTS);
+	if (self->spi_errno) {
+		// the device won't take SPI messages after all
+		spi_check(self);
+		goto unwind;
+	}
+	RELEASE_LOCK(self);
+
+	if (rx_thread) {
+		STORE_RELEASE(&self->rx_running, 1);
+		if ((errno = start_thread(&self->rx_thread, rxthread, self, &sched)) != 0) {
+			self->rx_running = 0;
+			PyErr_SetFromErrno(PyExc_OSError);
+			return NULL;
+		}
+	}
+	
+	Py_INCREF(Py_None);
+	return Py_None;
+
+unwind:
+	// leave the object closed rather than half open
+	self->transport->close(self);
+	self->transport = &spidev_transport;
+	if (self->irq_fd != -1) {
+		close(self->irq_fd);
+		self->irq_fd = -1;
+	}
+	RELEASE_LOCK(self);
+	return NULL;
+}
+
+static PyObject *
+MAX3100_open(MAX3100_Object *self, PyObject *args, PyObject *kwds)
+{
+	PyObject *result;
+	ACQUIRE_CTLLOCK(self);
+	result = MAX3100_open_locked(self, args, kwds);
+	RELEASE_CTLLOCK(self);
+	return result;
+}
+
+static int
+MAX3100_init(MAX3100_Object *self, PyObject *args, PyObject *kwds)
+{
+	int bus = -1;
+	int client = -1;
+	int crystal = -1;
+	int baud = -1;
+	int spispeed = -1;
+	int maxmisses = -1;
+	int batch = -1;
+	int rx_thread = 0;
+	int irq_chip = -1;
+	int irq_line = -1;
+	Py_ssize_t bufsize = -1;
+	const char *overflow = NULL;
+	const char *pollstr = NULL;
+	const char *transport = NULL;
+	int sim_fifo = -1;
+	int sim_rate = -1;
+	int sim_loopback = 0;
+	int bytesize = -1;
+	const char *paritystr = NULL;
+	int stopbits = -1;
+	int fifo = 1;
+	int irda = 0;
+	int rtscts = 0;
+	Py_ssize_t txbufsize = 0;
+	int rt_priority = 0;
+	PyObject *cpu = Py_None;
+	int mlock = 0;
+	static char *kwlist[] = {"bus", "client", "crystal", "baud", "spispeed", "maxmisses", "batch", "rx_thread",
+	                         "irq_chip", "irq_line", "bufsize", "overflow", "poll",
+	                         "transport", "sim_fifo", "sim_rate", "sim_loopback",
+	                         "bytesize", "parity", "stopbits", "fifo", "irda", "rtscts", "txbufsize",
+	                         "rt_priority", "cpu", "mlock", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iiiiiiipiinsssiipisipppniOp:__init__",
+			kwlist, &bus, &client, &crystal, &baud, &spispeed, &maxmisses, &batch, &rx_thread,
+			&irq_chip, &irq_line, &bufsize, &overflow, &pollstr,
+			&transport, &sim_fifo, &sim_rate, &sim_loopback,
+			&bytesize, &paritystr, &stopbits, &fifo, &irda, &rtscts, &txbufsize,
+			&rt_priority, &cpu, &mlock))
+		return -1;
+
+	if (bus >= 0 || transport != NULL) {
+		MAX3100_open(self, args, kwds);
+		if (PyErr_Occurred())
+			return -1;
+	}
+
+	return 0;
+}
+
+
+PyDoc_STRVAR(MAX3100_ObjectType_doc,
+	"MAX3100([bus],[client],[crystal],[baud],[spispeed],[maxmisses],[batch],[rx_thread],\n"
+	"        [irq_chip],[irq_line],[bufsize],[overflow],[poll],\n"
+	"        [transport],[sim_fifo],[sim_rate],[sim_loopback],\n"
+	"        [bytesize],[parity],[stopbits],[fifo],[irda],[rtscts],[txbufsize],\n"
+	"        [rt_priority],[cpu],[mlock]) -> Serial\n\n"
+	"Return a new MAX3100 object that is (optionally) connected to the\n"
+	"specified SPI device interface.\n");
+
+static
+PyObject *MAX3100_enter(PyObject *self, PyObject *args)
+{
     if (!PyArg_ParseTuple(args, ""))
         return NULL;
 
-    Py_INCREF(self);
-    return self;
+    Py_INCREF(self);
+    return self;
+}
+
+static
+PyObject *MAX3100_exit(MAX3100_Object *self, PyObject *args)
+{
+
+    PyObject *exc_type = 0;
+    PyObject *exc_value = 0;
+    PyObject *traceback = 0;
+    if (!PyArg_UnpackTuple(args, "__exit__", 3, 3, &exc_type, &exc_value,
+                           &traceback)) {
+        return 0;
+    }
+
+    MAX3100_close(self);
+    Py_RETURN_FALSE;
+}
+
+/* The methods that consume the receive ring take rxlock around the
+   MAX3100_*_locked versions above, so one runs at a time per object
+   whether or not a GIL serializes them. A capture() is the consumer
+   while it runs. */
+#define RX_METHOD(name) \
+static PyObject * \
+name(MAX3100_Object *self, PyObject *args, PyObject *kwds) \
+{ \
+	PyObject *result = NULL; \
+	ACQUIRE_RXLOCK(self); \
+	if (LOAD_ACQUIRE(&self->capture) != NULL) \
+		PyErr_SetString(PyExc_RuntimeError, busymsg_capture); \
+	else \
+		result = name##_locked(self, args, kwds); \
+	RELEASE_RXLOCK(self); \
+	return result; \
+}
+
+RX_METHOD(MAX3100_readbytes)
+RX_METHOD(MAX3100_transfer)
+RX_METHOD(MAX3100_readinto)
+RX_METHOD(MAX3100_read_until)
+RX_METHOD(MAX3100_read_frame)
+RX_METHOD(MAX3100_read_packet)
+RX_METHOD(MAX3100_bulk_transfer)
+RX_METHOD(MAX3100_read_to_fd)
+
+// One write() at a time fills the transmit queue, so they don't interleave.
+static PyObject *
+MAX3100_writebytes(MAX3100_Object *self, PyObject *args)
+{
+	PyObject *result;
+	ACQUIRE_TXLOCK(self);
+	result = MAX3100_writebytes_locked(self, args);
+	RELEASE_TXLOCK(self);
+	return result;
+}
+
+static PyMethodDef MAX3100_methods[] = {
+	{"open", (PyCFunction)MAX3100_open, METH_VARARGS | METH_KEYWORDS,
+		MAX3100_open_doc},
+	{"close", (PyCFunction)MAX3100_close, METH_NOARGS,
+		MAX3100_close_doc},
+	{"configure", (PyCFunction)MAX3100_configure, METH_VARARGS | METH_KEYWORDS,
+		MAX3100_configure_doc},
+	{"set_baud", (PyCFunction)MAX3100_set_baud, METH_VARARGS,
+		MAX3100_set_baud_doc},
+	{"available", (PyCFunction)MAX3100_available, METH_NOARGS,
+		MAX3100_available_doc},
+	{"clear", (PyCFunction)MAX3100_clear, METH_NOARGS,
+		MAX3100_clear_doc},
+	{"reset_input_buffer", (PyCFunction)MAX3100_clear, METH_NOARGS,
+		MAX3100_reset_input_buffer_doc},
+	{"reset_output_buffer", (PyCFunction)MAX3100_reset_output_buffer, METH_NOARGS,
+		MAX3100_reset_output_buffer_doc},
+	{"readable", (PyCFunction)MAX3100_true, METH_NOARGS,
+		"readable() -> True\n"},
+	{"writable", (PyCFunction)MAX3100_true, METH_NOARGS,
+		"writable() -> True\n"},
+	{"seekable", (PyCFunction)MAX3100_false, METH_NOARGS,
+		"seekable() -> False\n"},
+	{"isatty", (PyCFunction)MAX3100_false, METH_NOARGS,
+		"isatty() -> False\n"},
+	{"reset_stats", (PyCFunction)MAX3100_reset_stats, METH_NOARGS,
+		MAX3100_reset_stats_doc},
+	{"fileno", (PyCFunction)MAX3100_fileno, METH_NOARGS,
+		MAX3100_fileno_doc},
+	{"sim_inject", (PyCFunction)MAX3100_sim_inject, METH_VARARGS,
+		MAX3100_sim_inject_doc},
+	{"trace_start", (PyCFunction)MAX3100_trace_start, METH_VARARGS | METH_KEYWORDS,
+		MAX3100_trace_start_doc},
+	{"trace_stop", (PyCFunction)MAX3100_trace_stop, METH_NOARGS,
+		MAX3100_trace_stop_doc},
+	{"trace_dump", (PyCFunction)MAX3100_trace_dump, METH_NOARGS,
+		MAX3100_trace_dump_doc},
+	{"trace_export", (PyCFunction)MAX3100_trace_export, METH_VARARGS,
+		MAX3100_trace_export_doc},
+	{"read", (PyCFunction)MAX3100_readbytes, METH_VARARGS | METH_KEYWORDS,
+		MAX3100_read_doc},
+	{"readinto", (PyCFunction)MAX3100_readinto, METH_VARARGS | METH_KEYWORDS,
+		MAX3100_readinto_doc},
+	{"transfer", (PyCFunction)MAX3100_transfer, METH_VARARGS | METH_KEYWORDS,
+		MAX3100_transfer_doc},
+	{"flush", (PyCFunction)MAX3100_flush, METH_NOARGS,
+		MAX3100_flush_doc},
+	{"read_until", (PyCFunction)MAX3100_read_until, METH_VARARGS | METH_KEYWORDS,
+		MAX3100_read_until_doc},
+	{"read_frame", (PyCFunction)MAX3100_read_frame, METH_VARARGS | METH_KEYWORDS,
+		MAX3100_read_frame_doc},
+	{"set_packet_format", (PyCFunction)MAX3100_set_packet_format, METH_VARARGS | METH_KEYWORDS,
+		MAX3100_set_packet_format_doc},
+	{"read_packet", (PyCFunction)MAX3100_read_packet, METH_VARARGS | METH_KEYWORDS,
+		MAX3100_read_packet_doc},
+	{"bulk_transfer", (PyCFunction)MAX3100_bulk_transfer, METH_VARARGS | METH_KEYWORDS,
+		MAX3100_bulk_transfer_doc},
+	{"read_to_fd", (PyCFunction)MAX3100_read_to_fd, METH_VARARGS | METH_KEYWORDS,
+		MAX3100_read_to_fd_doc},
+	{"capture", (PyCFunction)MAX3100_capture, METH_VARARGS | METH_KEYWORDS,
+		MAX3100_capture_doc},
+	{"capture_wait", (PyCFunction)MAX3100_capture_wait, METH_VARARGS | METH_KEYWORDS,
+		MAX3100_capture_wait_doc},
+	{"capture_stop", (PyCFunction)MAX3100_capture_stop, METH_NOARGS,
+		MAX3100_capture_stop_doc},
+	{"write", (PyCFunction)MAX3100_writebytes, METH_VARARGS,
+		MAX3100_write_doc},
+	{"__enter__", (PyCFunction)MAX3100_enter, METH_VARARGS,
+		NULL},
+	{"__exit__", (PyCFunction)MAX3100_exit, METH_VARARGS,
+		NULL},
+	{NULL},
+};
+
+static PyObject *
+timeout_to_object(int64_t ns)
+{
+	if (ns < 0)
+		Py_RETURN_NONE;
+	return PyFloat_FromDouble(ns/1e9);
+}
+
+static PyObject *
+MAX3100_get_timeout(MAX3100_Object *self, void *closure)
+{
+	return timeout_to_object(LOAD_ACQUIRE(&self->timeout_ns));
+}
+
+static int
+MAX3100_set_timeout(MAX3100_Object *self, PyObject *val, void *closure)
+{
+	int64_t ns;
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError, "Cannot delete attribute");
+		return -1;
+	}
+	if (parse_timeout(val, &ns) == -1)
+		return -1;
+	STORE_RELEASE(&self->timeout_ns, ns);
+	return 0;
+}
+
+static PyObject *
+MAX3100_get_inter_byte_timeout(MAX3100_Object *self, void *closure)
+{
+	return timeout_to_object(LOAD_ACQUIRE(&self->inter_byte_timeout_ns));
+}
+
+static int
+MAX3100_set_inter_byte_timeout(MAX3100_Object *self, PyObject *val, void *closure)
+{
+	int64_t ns;
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError, "Cannot delete attribute");
+		return -1;
+	}
+	if (parse_timeout(val, &ns) == -1)
+		return -1;
+	STORE_RELEASE(&self->inter_byte_timeout_ns, ns);
+	return 0;
+}
+
+static PyObject *
+MAX3100_get_overflows(MAX3100_Object *self, void *closure)
+{
+	return PyLong_FromUnsignedLongLong(self->stats.overflows);
+}
+
+static PyObject *
+MAX3100_get_stats(MAX3100_Object *self, void *closure)
+{
+	MAX3100_Stats st = self->stats;
+	return Py_BuildValue("{sKsKsKsKsKsKsKsKsKsKsKsKsKsKsKsIsI}",
+		"ioctls", (unsigned long long)st.ioctls,
+		"words", (unsigned long long)st.words,
+		"spi_ns", (unsigned long long)st.spi_ns,
+		"polls", (unsigned long long)st.polls,
+		"empty_words", (unsigned long long)st.empty_words,
+		"rx_chars", (unsigned long long)st.rx_chars,
+		"tx_chars", (unsigned long long)st.tx_chars,
+		"tx_waits", (unsigned long long)st.tx_waits,
+		"overflows", (unsigned long long)st.overflows,
+		"parity_errors", (unsigned long long)st.parity_errors,
+		"wakeups", (unsigned long long)st.wakeups,
+		"wake_late_ns", (unsigned long long)st.wake_late_ns,
+		"wake_late_max_ns", (unsigned long long)st.wake_late_max_ns,
+		"packets", (unsigned long long)st.packets,
+		"packet_errors", (unsigned long long)st.packet_errors,
+		"high_water", st.high_water,
+		"buffered", ringcount(self));
+}
+
+
+static PyObject *
+MAX3100_get_rx_thread(MAX3100_Object *self, void *closure)
+{
+	return PyBool_FromLong(BACKGROUND_RX(self));
+}
+
+static PyObject *
+MAX3100_get_closed(MAX3100_Object *self, void *closure)
+{
+	return PyBool_FromLong(!IS_OPEN(self));
+}
+
+static PyObject *
+MAX3100_get_is_open(MAX3100_Object *self, void *closure)
+{
+	return PyBool_FromLong(IS_OPEN(self));
+}
+
+static PyObject *
+MAX3100_get_baudrate(MAX3100_Object *self, void *closure)
+{
+	return PyLong_FromLong(self->baud);
+}
+
+static int
+MAX3100_set_baudrate(MAX3100_Object *self, PyObject *val, void *closure)
+{
+	int baud;
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError, "Cannot delete attribute");
+		return -1;
+	}
+	if ((baud = PyLong_AsLong(val)) == -1 && PyErr_Occurred())
+		return -1;
+	return reconfigure(self, baud, -1, -1, NULL, -1, -1, -1);
+}
+
+static PyObject *
+MAX3100_get_bytesize(MAX3100_Object *self, void *closure)
+{
+	return PyLong_FromLong((self->conf & MAX3100_CONF_L) ? 7 : 8);
+}
+
+static int
+MAX3100_set_bytesize(MAX3100_Object *self, PyObject *val, void *closure)
+{
+	int bytesize;
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError, "Cannot delete attribute");
+		return -1;
+	}
+	if ((bytesize = PyLong_AsLong(val)) == -1 && PyErr_Occurred())
+		return -1;
+	return reconfigure(self, -1, -1, bytesize, NULL, -1, -1, -1);
+}
+
+static PyObject *
+MAX3100_get_parity(MAX3100_Object *self, void *closure)
+{
+	return PyUnicode_FromString(self->parity == PARITY_EVEN ? "E" : self->parity == PARITY_ODD ? "O" : "N");
+}
+
+static int
+MAX3100_set_parity(MAX3100_Object *self, PyObject *val, void *closure)
+{
+	const char *parity;
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError, "Cannot delete attribute");
+		return -1;
+	}
+	if ((parity = PyUnicode_AsUTF8(val)) == NULL)
+		return -1;
+	return reconfigure(self, -1, -1, -1, parity, -1, -1, -1);
+}
+
+static PyObject *
+MAX3100_get_stopbits(MAX3100_Object *self, void *closure)
+{
+	return PyLong_FromLong((self->conf & MAX3100_CONF_ST) ? 2 : 1);
+}
+
+static int
+MAX3100_set_stopbits(MAX3100_Object *self, PyObject *val, void *closure)
+{
+	int stopbits;
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError, "Cannot delete attribute");
+		return -1;
+	}
+	if ((stopbits = PyLong_AsLong(val)) == -1 && PyErr_Occurred())
+		return -1;
+	return reconfigure(self, -1, -1, -1, NULL, stopbits, -1, -1);
+}
+
+static PyObject *
+MAX3100_get_out_waiting(MAX3100_Object *self, void *closure)
+{
+	return PyLong_FromUnsignedLong(self->txbuf != NULL ? txcount(self) : 0);
+}
+
+static PyObject *
+MAX3100_get_write_timeout(MAX3100_Object *self, void *closure)
+{
+	return timeout_to_object(LOAD_ACQUIRE(&self->write_timeout_ns));
+}
+
+static int
+MAX3100_set_write_timeout(MAX3100_Object *self, PyObject *val, void *closure)
+{
+	int64_t ns;
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError, "Cannot delete attribute");
+		return -1;
+	}
+	if (parse_timeout(val, &ns) == -1)
+		return -1;
+	STORE_RELEASE(&self->write_timeout_ns, ns);
+	return 0;
+}
+
+static PyObject *
+MAX3100_get_rts(MAX3100_Object *self, void *closure)
+{
+	return PyBool_FromLong(self->rts != 0);
+}
+
+static int
+MAX3100_set_rts(MAX3100_Object *self, PyObject *val, void *closure)
+{
+	int rts;
+	uint32_t end;
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError, "Cannot delete attribute");
+		return -1;
+	}
+	if ((rts = PyObject_IsTrue(val)) == -1)
+		return -1;
+	ACQUIRE_LOCK(self);
+	end = self->bufend;
+	setrts(self, rts ? MAX3100_DATA_RTS : 0);
+	ringnotify(self, end);
+	RELEASE_LOCK(self);
+	return spi_check(self);
 }
 
-static
-PyObject *MAX3100_exit(MAX3100_Object *self, PyObject *args)
+static PyObject *
+MAX3100_get_cts(MAX3100_Object *self, void *closure)
 {
+	uint16_t cts;
+	uint32_t end;
+	if (BACKGROUND_RX(self)) {
+		// kept up to date by the thread draining the FIFO
+		return PyBool_FromLong(self->cts != 0);
+	}
+	ACQUIRE_LOCK(self);
+	end = self->bufend;
+	capture(self, transfer16(self, MAX3100_CMD_READ_DATA));
+	cts = self->cts;
+	ringnotify(self, end);
+	RELEASE_LOCK(self);
+	if (spi_check(self) == -1)
+		return NULL;
+	return PyBool_FromLong(cts != 0);
+}
 
-    PyObject *exc_type = 0;
-    PyObject *exc_value = 0;
-    PyObject *traceback = 0;
-    if (!PyArg_UnpackTuple(args, "__exit__", 3, 3, &exc_type, &exc_value,
-                           &traceback)) {
-        return 0;
-    }
+static PyObject *
+MAX3100_get_rtscts(MAX3100_Object *self, void *closure)
+{
+	return PyBool_FromLong(self->rtscts);
+}
 
-    MAX3100_close(self);
-    Py_RETURN_FALSE;
+static int
+MAX3100_set_rtscts(MAX3100_Object *self, PyObject *val, void *closure)
+{
+	int rtscts;
+	uint32_t end;
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError, "Cannot delete attribute");
+		return -1;
+	}
+	if ((rtscts = PyObject_IsTrue(val)) == -1)
+		return -1;
+	ACQUIRE_LOCK(self);
+	self->rtscts = rtscts;
+	if (rtscts) {
+		end = self->bufend;
+		flowcontrol(self);
+		ringnotify(self, end);
+	}
+	RELEASE_LOCK(self);
+	return spi_check(self);
 }
 
-static PyMethodDef MAX3100_methods[] = {
-	{"open", (PyCFunction)MAX3100_open, METH_VARARGS | METH_KEYWORDS,
-		MAX3100_open_doc},
-	{"close", (PyCFunction)MAX3100_close, METH_NOARGS,
-		MAX3100_close_doc},
-	{"available", (PyCFunction)MAX3100_available, METH_NOARGS,
-		MAX3100_available_doc},
-	{"clear", (PyCFunction)MAX3100_clear, METH_NOARGS,
-		MAX3100_clear_doc},
-	{"read", (PyCFunction)MAX3100_readbytes, METH_VARARGS | METH_KEYWORDS,
-		MAX3100_read_doc},
-	{"write", (PyCFunction)MAX3100_writebytes, METH_VARARGS,
-		MAX3100_write_doc},
-	{"__enter__", (PyCFunction)MAX3100_enter, METH_VARARGS,
-		NULL},
-	{"__exit__", (PyCFunction)MAX3100_exit, METH_VARARGS,
-		NULL},
-	{NULL},
-};
+static PyObject *
+MAX3100_get_sim_cts(MAX3100_Object *self, void *closure)
+{
+	int cts;
+	ACQUIRE_LOCK(self);
+	if (self->sim == NULL) {
+		RELEASE_LOCK(self);
+		Py_RETURN_NONE;
+	}
+	cts = self->sim->cts != 0;
+	RELEASE_LOCK(self);
+	return PyBool_FromLong(cts);
+}
+
+static int
+MAX3100_set_sim_cts(MAX3100_Object *self, PyObject *val, void *closure)
+{
+	int cts;
+	if (val == NULL) {
+		PyErr_SetString(PyExc_TypeError, "Cannot delete attribute");
+		return -1;
+	}
+	if ((cts = PyObject_IsTrue(val)) == -1)
+		return -1;
+	ACQUIRE_LOCK(self);
+	if (self->sim == NULL) {
+		RELEASE_LOCK(self);
+		PyErr_SetString(PyExc_RuntimeError, "Not connected to the simulated transport.");
+		return -1;
+	}
+	self->sim->cts = cts ? MAX3100_DATA_CTS : 0;
+	RELEASE_LOCK(self);
+	return 0;
+}
+
+static PyObject *
+MAX3100_get_transport(MAX3100_Object *self, void *closure)
+{
+	return PyUnicode_FromString(self->transport->name);
+}
+
+static PyObject *
+MAX3100_get_sim_overruns(MAX3100_Object *self, void *closure)
+{
+	unsigned long long overruns;
+	ACQUIRE_LOCK(self);
+	if (self->sim == NULL) {
+		RELEASE_LOCK(self);
+		Py_RETURN_NONE;
+	}
+	overruns = self->sim->overruns;
+	RELEASE_LOCK(self);
+	return PyLong_FromUnsignedLongLong(overruns);
+}
 
 static PyGetSetDef MAX3100_getset[] = {
 	{"in_waiting", (getter)MAX3100_inwaiting, NULL,
 			"number of characters waiting\n"},
+	{"timeout", (getter)MAX3100_get_timeout, (setter)MAX3100_set_timeout,
+			"blocking read timeout in seconds, None waits forever\n"},
+	{"inter_byte_timeout", (getter)MAX3100_get_inter_byte_timeout,
+			(setter)MAX3100_set_inter_byte_timeout,
+			"maximum gap between characters of a blocking read, None disables\n"},
+	{"rx_thread", (getter)MAX3100_get_rx_thread, NULL,
+			"True while a background receive thread (its own, or a MAX3100Group's)\n"
+			"is draining the FIFO\n"},
+	{"stats", (getter)MAX3100_get_stats, NULL,
+			"dict of driver counters: ioctls, words, spi_ns, polls, empty_words,\n"
+			"rx_chars, tx_chars, tx_waits, overflows, parity_errors, wakeups,\n"
+			"wake_late_ns, wake_late_max_ns, packets, packet_errors, high_water\n"
+			"and buffered\n"},
+	{"overflows", (getter)MAX3100_get_overflows, NULL,
+			"number of received characters dropped because the buffer was full\n"},
+	{"closed", (getter)MAX3100_get_closed, NULL,
+			"True unless connected to a device\n"},
+	{"is_open", (getter)MAX3100_get_is_open, NULL,
+			"True while connected to a device\n"},
+	{"baudrate", (getter)MAX3100_get_baudrate, (setter)MAX3100_set_baudrate,
+			"baud rate; setting it reconfigures the open device, see configure()\n"},
+	{"bytesize", (getter)MAX3100_get_bytesize, (setter)MAX3100_set_bytesize,
+			"data bits, 7 or 8\n"},
+	{"parity", (getter)MAX3100_get_parity, (setter)MAX3100_set_parity,
+			"'N', 'E' or 'O'\n"},
+	{"stopbits", (getter)MAX3100_get_stopbits, (setter)MAX3100_set_stopbits,
+			"stop bits, 1 or 2\n"},
+	{"out_waiting", (getter)MAX3100_get_out_waiting, NULL,
+			"number of characters queued for transmission\n"},
+	{"write_timeout", (getter)MAX3100_get_write_timeout, (setter)MAX3100_set_write_timeout,
+			"write() timeout in seconds, None waits forever\n"},
+	{"rts", (getter)MAX3100_get_rts, (setter)MAX3100_set_rts,
+			"state of the RTS output, True when asserted\n"},
+	{"cts", (getter)MAX3100_get_cts, NULL,
+			"state of the CTS input, True when asserted\n"},
+	{"rtscts", (getter)MAX3100_get_rtscts, (setter)MAX3100_set_rtscts,
+			"automatic RTS/CTS flow control\n"},
+	{"sim_cts", (getter)MAX3100_get_sim_cts, (setter)MAX3100_set_sim_cts,
+			"CTS input of the simulated MAX3100, None if not simulated\n"},
+	{"transport", (getter)MAX3100_get_transport, NULL,
+			"'spidev' or 'sim'\n"},
+	{"sim_overruns", (getter)MAX3100_get_sim_overruns, NULL,
+			"characters the simulated MAX3100 lost to a full FIFO, None if not simulated\n"},
+	{"captured", (getter)MAX3100_get_captured, NULL,
+			"bytes stored so far by the capture in progress, 0 if none\n"},
   {NULL},
 };
 
-static PyTypeObject MAX3100_ObjectType = {
-#if PY_MAJOR_VERSION >= 3
-	PyVarObject_HEAD_INIT(NULL, 0)
-#else
-	PyObject_HEAD_INIT(NULL)
-	0,				/* ob_size */
-#endif
-	"MAX3100",			/* tp_name */
-	sizeof(MAX3100_Object),		/* tp_basicsize */
-	0,				/* tp_itemsize */
-	(destructor)MAX3100_dealloc,	/* tp_dealloc */
-	0,				/* tp_print */
-	0,				/* tp_getattr */
-	0,				/* tp_setattr */
-	0,				/* tp_compare */
-	0,				/* tp_repr */
-	0,				/* tp_as_number */
-	0,				/* tp_as_sequence */
-	0,				/* tp_as_mapping */
-	0,				/* tp_hash */
-	0,				/* tp_call */
-	0,				/* tp_str */
-	0,				/* tp_getattro */
-	0,				/* tp_setattro */
-	0,				/* tp_as_buffer */
-	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
-	MAX3100_ObjectType_doc,		/* tp_doc */
-	0,				/* tp_traverse */
-	0,				/* tp_clear */
-	0,				/* tp_richcompare */
-	0,				/* tp_weaklistoffset */
-	0,				/* tp_iter */
-	0,				/* tp_iternext */
-	MAX3100_methods,			/* tp_methods */
-	0,				/* tp_members */
-	MAX3100_getset,			  /* tp_getset */
-	0,				/* tp_base */
-	0,				/* tp_dict */
-	0,				/* tp_descr_get */
-	0,				/* tp_descr_set */
-	0,				/* tp_dictoffset */
-	(initproc)MAX3100_init,		/* tp_init */
-	0,				/* tp_alloc */
-	MAX3100_new,			/* tp_new */
+static PyType_Slot MAX3100_slots[] = {
+	{Py_tp_dealloc, (void *)MAX3100_dealloc},
+	{Py_tp_doc, (void *)MAX3100_ObjectType_doc},
+	{Py_tp_methods, (void *)MAX3100_methods},
+	{Py_tp_getset, (void *)MAX3100_getset},
+	{Py_tp_init, (void *)MAX3100_init},
+	{Py_tp_new, (void *)MAX3100_new},
+	{0, NULL}
+};
+
+static PyType_Spec MAX3100_spec = {
+	"max3100.MAX3100",
+	sizeof(MAX3100_Object),
+	0,
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	MAX3100_slots
+};
+
+// Module state, one per (sub)interpreter that imports max3100.
+typedef struct {
+	PyTypeObject *MAX3100_Type;
+	PyTypeObject *MAX3100Group_Type;
+} max3100_state;
+
+/* MAX3100Group: one native worker servicing several MAX3100 objects,
+   e.g. one per chip select on a shared bus. spidev binds each file
+   descriptor to a single chip select, so the worker still issues one
+   batched ioctl per chip, but the chips are serviced from one thread and
+   only when they can have data. */
+
+#define GROUP_ROUND_ROBIN 0
+#define GROUP_IRQ         1	/* highest priority asserted IRQ first */
+
+typedef struct {
+	PyObject_HEAD
+
+	PyObject *devices;	/* tuple of MAX3100 objects */
+	int policy;	/* GROUP_* scheduling policy */
+	pthread_mutex_t lock;	/* start() and stop() */
+	int running;
+	pthread_t thread;
+	MAX3100_Sched sched;	/* for the worker thread */
+	MAX3100_Stats stats;	/* only the wakeup counters are used */
+} MAX3100Group_Object;
+
+#define GROUP_DEV(self, i) ((MAX3100_Object *)PyTuple_GET_ITEM((self)->devices, (i)))
+
+static void *
+groupthread(void *arg)
+{
+	MAX3100Group_Object *self = (MAX3100Group_Object *)arg;
+	Py_ssize_t n = PyTuple_GET_SIZE(self->devices);
+	struct pollfd pfd[n];
+	struct gpioevent_data events[16];
+	MAX3100_Object *dev;
+	long idle_ns = 0;
+	int64_t txwait, wait;
+	Py_ssize_t ii, jj, next = 0;
+
+	for (ii = 0; ii < n; ii++) {
+		dev = GROUP_DEV(self, ii);
+		pfd[ii].fd = dev->irq_fd;
+		pfd[ii].events = POLLIN | POLLPRI;
+		if (idle_ns == 0 || dev->chartime_ns*MAX3100_FIFO/2 < idle_ns) {
+			idle_ns = dev->chartime_ns*MAX3100_FIFO/2;
+		}
+	}
+	while (LOAD_ACQUIRE(&self->running)) {
+		// transmit queues first, noting the soonest one can make progress
+		wait = 0;
+		for (ii = 0; ii < n; ii++) {
+			dev = GROUP_DEV(self, ii);
+			if (dev->txbuf && txcount(dev)) {
+				pthread_mutex_lock(&dev->lock);
+				txwait = txdrain(dev);
+				pthread_mutex_unlock(&dev->lock);
+				if (txwait && (wait == 0 || txwait < wait)) {
+					wait = txwait;
+				}
+			}
+		}
+		if (self->policy == GROUP_IRQ) {
+			// service the next asserted device after the last one serviced,
+			// so a busy device can't starve the others
+			for (jj = 0; jj < n; jj++) {
+				ii = (next + jj) % n;
+				dev = GROUP_DEV(self, ii);
+				if (irq_asserted(dev)) {
+					pthread_mutex_lock(&dev->lock);
+					fetchbytes(dev);
+					pthread_mutex_unlock(&dev->lock);
+					next = (ii + 1) % n;
+					break;
+				}
+			}
+			if (jj < n) {
+				continue;
+			}
+			// bounded so that stop() is noticed promptly
+			if (poll(pfd, n, wait ? (int)((wait + 999999)/1000000) : 50) > 0) {
+				for (ii = 0; ii < n; ii++) {
+					if (pfd[ii].revents) {
+						ssize_t ignored = read(pfd[ii].fd, events, sizeof events);
+						(void)ignored;
+					}
+				}
+			}
+		} else {
+			for (ii = 0; ii < n; ii++) {
+				dev = GROUP_DEV(self, ii);
+				pthread_mutex_lock(&dev->lock);
+				fetchbytes(dev);
+				pthread_mutex_unlock(&dev->lock);
+			}
+			note_wakeup(&self->stats, timed_sleep((wait && wait < idle_ns) ? wait : idle_ns));
+		}
+	}
+	return NULL;
+}
+
+PyDoc_STRVAR(MAX3100Group_stop_doc,
+	"stop()\n\n"
+	"Stop the worker thread; the devices go back to draining their own FIFOs\n"
+	"when read.\n");
+
+static PyObject *
+MAX3100Group_stop(MAX3100Group_Object *self)
+{
+	Py_ssize_t ii;
+	ACQUIRE_LOCK(self);
+	if (self->running) {
+		STORE_RELEASE(&self->running, 0);
+		Py_BEGIN_ALLOW_THREADS
+		pthread_join(self->thread, NULL);
+		Py_END_ALLOW_THREADS
+		for (ii = 0; ii < PyTuple_GET_SIZE(self->devices); ii++) {
+			STORE_RELEASE(&GROUP_DEV(self, ii)->grouped, 0);
+		}
+	}
+	RELEASE_LOCK(self);
+	Py_RETURN_NONE;
+}
+
+// Give the first n devices back after a failed start().
+static void group_release(MAX3100Group_Object *self, Py_ssize_t n) {
+	Py_ssize_t ii;
+	for (ii = 0; ii < n; ii++) {
+		STORE_RELEASE(&GROUP_DEV(self, ii)->grouped, 0);
+	}
+}
+
+PyDoc_STRVAR(MAX3100Group_start_doc,
+	"start()\n\n"
+	"Start the worker thread that drains every device's FIFO into its\n"
+	"receive buffer. The devices must be open and not have their own\n"
+	"receive thread.\n");
+
+static PyObject *
+MAX3100Group_start(MAX3100Group_Object *self)
+{
+	Py_ssize_t ii;
+	MAX3100_Object *dev;
+	const char *msg = NULL;
+	ACQUIRE_LOCK(self);
+	if (self->running) {
+		RELEASE_LOCK(self);
+		Py_RETURN_NONE;
+	}
+	if (self->devices == NULL) {
+		RELEASE_LOCK(self);
+		PyErr_SetString(PyExc_RuntimeError, "MAX3100Group has been cleared.");
+		return NULL;
+	}
+	// claim each device against a concurrent open(), close() or other group
+	for (ii = 0; ii < PyTuple_GET_SIZE(self->devices) && msg == NULL; ii++) {
+		dev = GROUP_DEV(self, ii);
+		ACQUIRE_CTLLOCK(dev);
+		if (!IS_OPEN(dev) || BACKGROUND_RX(dev)) {
+			msg = "Group devices must be open and not already drained by a receive thread.";
+		} else if (self->policy == GROUP_IRQ && dev->irq_fd == -1) {
+			msg = "policy 'irq' needs every device opened with irq_line.";
+		} else {
+			STORE_RELEASE(&dev->grouped, 1);
+		}
+		RELEASE_CTLLOCK(dev);
+	}
+	if (msg) {
+		group_release(self, ii - 1);
+		RELEASE_LOCK(self);
+		PyErr_SetString(PyExc_ValueError, msg);
+		return NULL;
+	}
+	memset(&self->stats, 0, sizeof(self->stats));
+	STORE_RELEASE(&self->running, 1);
+	if ((errno = start_thread(&self->thread, groupthread, self, &self->sched)) != 0) {
+		self->running = 0;
+		group_release(self, PyTuple_GET_SIZE(self->devices));
+		RELEASE_LOCK(self);
+		PyErr_SetFromErrno(PyExc_OSError);
+		return NULL;
+	}
+	RELEASE_LOCK(self);
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+MAX3100Group_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+	MAX3100Group_Object *self;
+	PyObject *devices;
+	const char *policy = "round_robin";
+	int rt_priority = 0;
+	PyObject *cpu = Py_None;
+	int mlock = 0;
+	MAX3100_Sched sched;
+	max3100_state *state;
+	Py_ssize_t ii, jj;
+	static char *kwlist[] = {"devices", "policy", "rt_priority", "cpu", "mlock", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|siOp:MAX3100Group", kwlist,
+	                                 &devices, &policy, &rt_priority, &cpu, &mlock))
+		return NULL;
+	if (parse_sched(rt_priority, cpu, &sched) == -1)
+		return NULL;
+	if (mlock && lock_memory() == -1)
+		return NULL;
+	if ((devices = PySequence_Tuple(devices)) == NULL)
+		return NULL;
+	if (PyTuple_GET_SIZE(devices) == 0) {
+		Py_DECREF(devices);
+		PyErr_SetString(PyExc_ValueError, "MAX3100Group needs at least one device.");
+		return NULL;
+	}
+	state = PyType_GetModuleState(type);
+	for (ii = 0; ii < PyTuple_GET_SIZE(devices); ii++) {
+		if (!PyObject_TypeCheck(PyTuple_GET_ITEM(devices, ii), state->MAX3100_Type)) {
+			Py_DECREF(devices);
+			PyErr_SetString(PyExc_TypeError, "MAX3100Group devices must be MAX3100 objects.");
+			return NULL;
+		}
+		for (jj = 0; jj < ii; jj++) {
+			if (PyTuple_GET_ITEM(devices, jj) == PyTuple_GET_ITEM(devices, ii)) {
+				Py_DECREF(devices);
+				PyErr_SetString(PyExc_ValueError, "MAX3100Group devices must be distinct.");
+				return NULL;
+			}
+		}
+	}
+	if ((self = (MAX3100Group_Object *)type->tp_alloc(type, 0)) == NULL) {
+		Py_DECREF(devices);
+		return NULL;
+	}
+	pthread_mutex_init(&self->lock, NULL);
+	self->devices = devices;
+	self->running = 0;
+	self->sched = sched;
+	if (strcmp(policy, "round_robin") == 0) {
+		self->policy = GROUP_ROUND_ROBIN;
+	} else if (strcmp(policy, "irq") == 0) {
+		self->policy = GROUP_IRQ;
+	} else {
+		Py_DECREF(self);
+		PyErr_SetString(PyExc_ValueError, "policy must be 'round_robin' or 'irq'.");
+		return NULL;
+	}
+	return (PyObject *)self;
+}
+
+static int
+MAX3100Group_traverse(MAX3100Group_Object *self, visitproc visit, void *arg)
+{
+	Py_VISIT(Py_TYPE(self));
+	Py_VISIT(self->devices);
+	return 0;
+}
+
+/* Break reference cycles through the devices (say a MAX3100 subclass
+   keeping its group as an attribute). The worker borrows the devices, so
+   it is stopped before they are let go. */
+static int
+MAX3100Group_clear(MAX3100Group_Object *self)
+{
+	if (self->devices) {
+		PyObject *ref = MAX3100Group_stop(self);
+		Py_XDECREF(ref);
+		Py_CLEAR(self->devices);
+	}
+	return 0;
+}
+
+static void
+MAX3100Group_dealloc(MAX3100Group_Object *self)
+{
+	PyTypeObject *tp = Py_TYPE(self);
+	PyObject_GC_UnTrack(self);
+	MAX3100Group_clear(self);
+	pthread_mutex_destroy(&self->lock);
+	tp->tp_free((PyObject *)self);
+	Py_DECREF(tp);
+}
+
+static PyObject *
+MAX3100Group_enter(PyObject *self, PyObject *args)
+{
+	PyObject *ref = MAX3100Group_start((MAX3100Group_Object *)self);
+	if (ref == NULL)
+		return NULL;
+	Py_DECREF(ref);
+	Py_INCREF(self);
+	return self;
+}
+
+static PyObject *
+MAX3100Group_exit(MAX3100Group_Object *self, PyObject *args)
+{
+	PyObject *ref = MAX3100Group_stop(self);
+	Py_XDECREF(ref);
+	Py_RETURN_FALSE;
+}
+
+static PyObject *
+MAX3100Group_get_devices(MAX3100Group_Object *self, void *closure)
+{
+	if (self->devices == NULL)
+		return PyTuple_New(0);
+	Py_INCREF(self->devices);
+	return self->devices;
+}
+
+static PyObject *
+MAX3100Group_get_running(MAX3100Group_Object *self, void *closure)
+{
+	return PyBool_FromLong(self->running);
+}
+
+static PyObject *
+MAX3100Group_get_stats(MAX3100Group_Object *self, void *closure)
+{
+	MAX3100_Stats st = self->stats;
+	return Py_BuildValue("{sKsKsK}",
+		"wakeups", (unsigned long long)st.wakeups,
+		"wake_late_ns", (unsigned long long)st.wake_late_ns,
+		"wake_late_max_ns", (unsigned long long)st.wake_late_max_ns);
+}
+
+static PyMethodDef MAX3100Group_methods[] = {
+	{"start", (PyCFunction)MAX3100Group_start, METH_NOARGS,
+		MAX3100Group_start_doc},
+	{"stop", (PyCFunction)MAX3100Group_stop, METH_NOARGS,
+		MAX3100Group_stop_doc},
+	{"__enter__", (PyCFunction)MAX3100Group_enter, METH_NOARGS,
+		NULL},
+	{"__exit__", (PyCFunction)MAX3100Group_exit, METH_VARARGS,
+		NULL},
+	{NULL},
 };
 
+static PyGetSetDef MAX3100Group_getset[] = {
+	{"devices", (getter)MAX3100Group_get_devices, NULL,
+			"tuple of the MAX3100 objects serviced by this group\n"},
+	{"running", (getter)MAX3100Group_get_running, NULL,
+			"True while the worker thread is running\n"},
+	{"stats", (getter)MAX3100Group_get_stats, NULL,
+			"dict of worker wakeup counters since start(): wakeups, wake_late_ns\n"
+			"and wake_late_max_ns (round_robin policy only)\n"},
+	{NULL},
+};
+
+PyDoc_STRVAR(MAX3100Group_ObjectType_doc,
+	"MAX3100Group(devices, policy='round_robin', rt_priority=0, cpu=None, mlock=False) -> Group\n\n"
+	"Service several open MAX3100 objects (e.g. /dev/spidev0.0, 0.1, ...)\n"
+	"from one native worker thread started with start() or a with block.\n"
+	"The worker drains each device's FIFO into its receive buffer, so their\n"
+	"read() calls never touch the bus. policy 'round_robin' visits every\n"
+	"device in turn; 'irq' needs every device opened with irq_line and\n"
+	"services devices with asserted IRQs in turn, sleeping in poll() otherwise.\n"
+	"rt_priority, cpu and mlock schedule the worker as for MAX3100.open().\n");
+
+static PyType_Slot MAX3100Group_slots[] = {
+	{Py_tp_dealloc, (void *)MAX3100Group_dealloc},
+	{Py_tp_traverse, (void *)MAX3100Group_traverse},
+	{Py_tp_clear, (void *)MAX3100Group_clear},
+	{Py_tp_doc, (void *)MAX3100Group_ObjectType_doc},
+	{Py_tp_methods, (void *)MAX3100Group_methods},
+	{Py_tp_getset, (void *)MAX3100Group_getset},
+	{Py_tp_new, (void *)MAX3100Group_new},
+	{0, NULL}
+};
+
+static PyType_Spec MAX3100Group_spec = {
+	"max3100.MAX3100Group",
+	sizeof(MAX3100Group_Object),
+	0,
+	Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+	MAX3100Group_slots
+};
+
+PyDoc_STRVAR(MAX3100_checksum_doc,
+	"checksum(data, kind='crc16') -> int\n\n"
+	"The checksum of data as read_packet() computes it: kind is 'sum8',\n"
+	"'crc16' or 'crc32'. Handy for building packets to send.\n");
+
+static PyObject *
+MAX3100_checksum(PyObject *module, PyObject *args, PyObject *kwds)
+{
+	Py_buffer view;
+	const char *kind = "crc16";
+	uint8_t check;
+	uint32_t value;
+	static char *kwlist[] = {"data", "kind", NULL};
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|s:checksum", kwlist, &view, &kind))
+		return NULL;
+	if (strcmp(kind, "sum8") == 0) {
+		check = CHECK_SUM8;
+	} else if (strcmp(kind, "crc16") == 0) {
+		check = CHECK_CRC16;
+	} else if (strcmp(kind, "crc32") == 0) {
+		check = CHECK_CRC32;
+	} else {
+		PyBuffer_Release(&view);
+		PyErr_SetString(PyExc_ValueError, "kind must be 'sum8', 'crc16' or 'crc32'.");
+		return NULL;
+	}
+	Py_BEGIN_ALLOW_THREADS
+	value = checksum(check, view.buf, view.len);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&view);
+	return PyLong_FromUnsignedLong(value);
+}
+
 static PyMethodDef MAX3100_module_methods[] = {
+	{"checksum", (PyCFunction)MAX3100_checksum, METH_VARARGS | METH_KEYWORDS,
+		MAX3100_checksum_doc},
 	{NULL}
 };
 
-#if PY_MAJOR_VERSION >= 3
+static int
+max3100_exec(PyObject *m)
+{
+	max3100_state *state = PyModule_GetState(m);
+
+	pthread_once(&crc_once, crc_init);
+	state->MAX3100_Type = (PyTypeObject *)PyType_FromModuleAndSpec(m, &MAX3100_spec, NULL);
+	if (state->MAX3100_Type == NULL || PyModule_AddType(m, state->MAX3100_Type) < 0)
+		return -1;
+	state->MAX3100Group_Type = (PyTypeObject *)PyType_FromModuleAndSpec(m, &MAX3100Group_spec, NULL);
+	if (state->MAX3100Group_Type == NULL || PyModule_AddType(m, state->MAX3100Group_Type) < 0)
+		return -1;
+	if (PyModule_AddStringConstant(m, "__version__", _VERSION_) < 0 ||
+	    PyModule_AddStringConstant(m, "TRACE_FORMAT", TRACE_FORMAT) < 0)
+		return -1;
+
+	// Let MAX3100 objects pass for raw streams, e.g. inside io.BufferedReader.
+	PyObject *io = PyImport_ImportModule("io");
+	PyObject *rawio = io ? PyObject_GetAttrString(io, "RawIOBase") : NULL;
+	PyObject *res = rawio ? PyObject_CallMethod(rawio, "register", "O", (PyObject *)state->MAX3100_Type) : NULL;
+	Py_XDECREF(rawio);
+	Py_XDECREF(io);
+	if (res == NULL)
+		return -1;
+	Py_DECREF(res);
+	return 0;
+}
+
+static int
+max3100_traverse(PyObject *m, visitproc visit, void *arg)
+{
+	max3100_state *state = PyModule_GetState(m);
+	Py_VISIT(state->MAX3100_Type);
+	Py_VISIT(state->MAX3100Group_Type);
+	return 0;
+}
+
+static int
+max3100_clear(PyObject *m)
+{
+	max3100_state *state = PyModule_GetState(m);
+	Py_CLEAR(state->MAX3100_Type);
+	Py_CLEAR(state->MAX3100Group_Type);
+	return 0;
+}
+
+static void
+max3100_free(void *m)
+{
+	max3100_clear((PyObject *)m);
+}
+
+/* Objects keep their own state and locks, and the module's only globals
+   are the CRC tables, filled in once; so each (sub)interpreter can have
+   its own module, and free-threaded builds can run it without the GIL. */
+static PyModuleDef_Slot max3100_slots[] = {
+	{Py_mod_exec, max3100_exec},
+#ifdef Py_mod_multiple_interpreters
+	{Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+	{Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+	{0, NULL}
+};
+
 static struct PyModuleDef moduledef = {
 	PyModuleDef_HEAD_INIT,
 	"max3100",
 	MAX3100_module_doc,
-	-1,
+	sizeof(max3100_state),
 	MAX3100_module_methods,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
+	max3100_slots,
+	max3100_traverse,
+	max3100_clear,
+	max3100_free,
 };
-#else
-#ifndef PyMODINIT_FUNC	/* declarations for DLL import/export */
-#define PyMODINIT_FUNC void
-#endif
-#endif
 
-#if PY_MAJOR_VERSION >= 3
 PyMODINIT_FUNC
 PyInit_max3100(void)
-#else
-void initmax3100(void)
-#endif
 {
-	PyObject* m;
-
-	if (PyType_Ready(&MAX3100_ObjectType) < 0)
-#if PY_MAJOR_VERSION >= 3
-		return NULL;
-#else
-		return;
-#endif
-
-#if PY_MAJOR_VERSION >= 3
-	m = PyModule_Create(&moduledef);
-	PyObject *version = PyUnicode_FromString(_VERSION_);
-#else
-	m = Py_InitModule3("max3100", MAX3100_module_methods, MAX3100_module_doc);
-	PyObject *version = PyString_FromString(_VERSION_);
-#endif
-
-	PyObject *dict = PyModule_GetDict(m);
-	PyDict_SetItemString(dict, "__version__", version);
-	Py_DECREF(version);
-
-	Py_INCREF(&MAX3100_ObjectType);
-	PyModule_AddObject(m, "MAX3100", (PyObject *)&MAX3100_ObjectType);
-
-#if PY_MAJOR_VERSION >= 3
-	return m;
-#endif
+	return PyModuleDef_Init(&moduledef);
 }
@@ -42,9 +42,7 @@ def max3100_thread(baud,length):
     while True:
         b = makebytes(6)
         print("%4d characters (%s) to send (SPI)"%(len(b),b))
-        max3100.write(b)
-        time.sleep(0.0005)
-        b = max3100.read()
+        b = max3100.transfer(b, timeout=1.0)
         print("%4d characters (%s) received (SPI)"%(len(b),bytes(b)))
         time.sleep(1)
 
@@ -16,9 +16,8 @@ classifiers = ['Development Status :: 5 - Production/Stable',
                'Operating System :: POSIX :: Linux',
                'License :: OSI Approved :: MIT License',
                'Intended Audience :: Developers',
-               'Programming Language :: Python :: 2.6',
-               'Programming Language :: Python :: 2.7',
                'Programming Language :: Python :: 3',
+               'Programming Language :: Python :: 3 :: Only',
                'Topic :: Software Development',
                'Topic :: System :: Hardware',
                'Topic :: System :: Hardware :: Hardware Drivers']
@@ -34,6 +33,8 @@ setup(	name		= "max3100",
 	maintainer_email= "edwardsnj@gmail.com",
 	license		= "MIT",
 	classifiers	= classifiers,
+	python_requires	= ">=3.9",
 	url		= "http://github.com/silver-sat/py-max3100",
-	ext_modules	= [Extension("max3100", ["max3100_module.c"])]
+	ext_modules	= [Extension("max3100", ["max3100_module.c"])],
+	py_modules	= ["max3100_asyncio"]
 )
@@ -0,0 +1,51 @@
+#!/bin/env python3
+# read_packet() framing on the simulated MAX3100, no hardware needed.
+import sys, struct
+
+import max3100
+
+def ucam(ident, data):
+    pkt = struct.pack('<HH', ident, len(data)) + data
+    return pkt + struct.pack('<H', max3100.checksum(pkt, kind='sum8'))
+
+def device():
+    # a deep simulated FIFO, so a late rx thread wakeup can't drop bytes
+    dev = max3100.MAX3100(transport='sim', baud=115200, rx_thread=True, sim_fifo=256)
+    dev.timeout = 1.0
+    dev.set_packet_format(preset='ucam')
+    return dev
+
+one = ucam(1, bytes(range(10)))
+two = ucam(2, bytes(range(100, 200)) * 5)
+
+print("misaligned prefix", file=sys.stderr)
+dev = device()
+dev.sim_inject(b'zz' + one + two)
+assert dev.read_packet() == one
+assert dev.read_packet() == two
+assert dev.sim_overruns == 0
+dev.close()
+
+print("corrupt packet, then a valid one", file=sys.stderr)
+dev = device()
+bad = bytearray(one)
+bad[6] ^= 0xff
+dev.sim_inject(bytes(bad) + two)
+assert dev.read_packet() == two
+assert dev.stats['packet_errors'] > 0
+assert dev.sim_overruns == 0
+dev.close()
+
+print("packets longer than the receive buffer", file=sys.stderr)
+dev = max3100.MAX3100(transport='sim', bufsize=256)
+for kwds in ({'preset': 'ucam'}, {'length': 512}, {'length_offset': 0, 'max_length': 1024}):
+    try:
+        dev.set_packet_format(**kwds)
+    except ValueError:
+        pass
+    else:
+        raise AssertionError(kwds)
+dev.set_packet_format(length=256)
+dev.close()
+
+print("passed", file=sys.stderr)